@@ -0,0 +1,80 @@
+#ifndef RAYTRACER_AABB_H
+#define RAYTRACER_AABB_H
+
+#include "interval.h"
+#include "ray.h"
+
+// Axis-aligned bounding box
+class AABB {
+public:
+    Interval x, y, z;
+
+    AABB() {} // The default AABB is empty, since intervals are empty by default
+
+    AABB(const Interval& ix, const Interval& iy, const Interval& iz) : x(ix), y(iy), z(iz) {}
+
+    AABB(const Point3& a, const Point3& b) {
+        // Treat the two points a and b as extrema for the bounding box, so we don't require a
+        // particular minimum/maximum coordinate order
+        x = Interval(fmin(a[0], b[0]), fmax(a[0], b[0]));
+        y = Interval(fmin(a[1], b[1]), fmax(a[1], b[1]));
+        z = Interval(fmin(a[2], b[2]), fmax(a[2], b[2]));
+    }
+
+    AABB(const AABB& box0, const AABB& box1) : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {}
+
+    [[nodiscard]] const Interval& axis(int n) const {
+        if (n == 1) return y;
+        if (n == 2) return z;
+        return x;
+    }
+
+    [[nodiscard]] bool isEmpty() const {
+        return x.min > x.max || y.min > y.max || z.min > z.max;
+    }
+
+    [[nodiscard]] Point3 centroid() const {
+        return Point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
+    // Returns the index of the axis with the largest extent
+    [[nodiscard]] int longestAxis() const {
+        if (x.size() > y.size()) {
+            return x.size() > z.size() ? 0 : 2;
+        }
+        return y.size() > z.size() ? 1 : 2;
+    }
+
+    [[nodiscard]] double surfaceArea() const {
+        if (isEmpty()) return 0;
+        auto dx = x.size();
+        auto dy = y.size();
+        auto dz = z.size();
+        return 2.0 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    // Slab test, returns true if the ray overlaps the box anywhere inside ray_t
+    [[nodiscard]] bool hit(const Ray& r, Interval ray_t) const {
+        for (int a = 0; a < 3; a++) {
+            auto inv_d = 1 / r.direction()[a];
+            auto orig = r.origin()[a];
+
+            auto t0 = (axis(a).min - orig) * inv_d;
+            auto t1 = (axis(a).max - orig) * inv_d;
+
+            if (inv_d < 0) {
+                std::swap(t0, t1);
+            }
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif //RAYTRACER_AABB_H
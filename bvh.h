@@ -0,0 +1,622 @@
+#ifndef RAYTRACER_BVH_H
+#define RAYTRACER_BVH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "hittable.h"
+#include "hittable_list.h"
+
+struct BvhBuildStats {
+    double build_seconds = 0;
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    size_t primitive_count = 0;
+    size_t memory_bytes = 0; // Nodes plus primitive references
+    unsigned int threads = 1;
+
+    [[nodiscard]] double bytesPerPrimitive() const {
+        return primitive_count > 0 ? static_cast<double>(memory_bytes) / primitive_count : 0.0;
+    }
+};
+
+// Memory locality of the traversals on one thread. While enabled, every node and leaf batch that a traversal reads
+// goes through a model of a 32 KiB, 8-way set-associative LRU cache of 64 byte lines, like a typical L1 data cache,
+// so the effect of ray order on locality can be measured the same way on any machine, without hardware counters.
+struct TraversalCounters {
+    static constexpr size_t line_bytes = 64;
+    static constexpr size_t ways = 8;
+    static constexpr size_t sets = 64;
+
+    bool enabled = false;
+    uint64_t node_fetches = 0; // Nodes and leaf batches read
+    uint64_t line_reads = 0;
+    uint64_t line_misses = 0;
+    uintptr_t tags[sets][ways] = {}; // Most recently used first
+
+    void touch(const void* data, size_t bytes) {
+        ++node_fetches;
+        auto first = reinterpret_cast<uintptr_t>(data) / line_bytes;
+        auto last = (reinterpret_cast<uintptr_t>(data) + bytes - 1) / line_bytes;
+        for (auto line = first; line <= last; ++line) {
+            ++line_reads;
+            auto* set = tags[line % sets];
+            auto way = std::find(set, set + ways - 1, line) - set;
+            if (set[way] != line) {
+                ++line_misses;
+            }
+            std::copy_backward(set, set + way, set + way + 1);
+            set[0] = line;
+        }
+    }
+};
+
+inline thread_local TraversalCounters traversal_counters;
+
+// Starts loading every cache line of [data, data + bytes) without waiting for it
+inline void prefetchLines(const void* data, size_t bytes) {
+    constexpr size_t line_bytes = 64;
+    auto first = reinterpret_cast<uintptr_t>(data) / line_bytes;
+    auto last = (reinterpret_cast<uintptr_t>(data) + bytes - 1) / line_bytes;
+    for (auto line = first; line <= last; ++line) {
+        __builtin_prefetch(reinterpret_cast<const void*>(line * line_bytes));
+    }
+}
+
+// Absolute padding that keeps float copies of boxes inside the given scene bounds conservative
+inline double floatBoxPadding(const AABB& scene_box) {
+    auto extent = fmax(fmax(fmax(fabs(scene_box.x.min), fabs(scene_box.x.max)),
+                            fmax(fabs(scene_box.y.min), fabs(scene_box.y.max))),
+                       fmax(fabs(scene_box.z.min), fabs(scene_box.z.max)));
+    return std::isfinite(extent) ? extent * 1e-6 : 0.0;
+}
+
+inline float roundDownToFloat(double x) {
+    return std::nextafter(static_cast<float>(x), -HUGE_VALF);
+}
+
+inline float roundUpToFloat(double x) {
+    return std::nextafter(static_cast<float>(x), HUGE_VALF);
+}
+
+// Node of the intermediate binary tree produced by BvhBuilder
+struct BvhBuildNode {
+    AABB bbox;
+    std::unique_ptr<BvhBuildNode> children[2];
+    size_t first_primitive = 0; // Offset into BvhBuilder::order, leaves only
+    size_t primitive_count = 0;
+    int axis = 0; // Split axis, interior nodes only
+
+    [[nodiscard]] bool isLeaf() const { return !children[0]; }
+};
+
+// Builds a binary hierarchy over a set of primitive boxes top-down with a binned surface area heuristic (SAH).
+// Subtrees are built as parallel tasks and the centroid binning of the top levels is split across threads. Both draw
+// their helper threads from one shared budget, so no more than `threads` run at once however the tasks nest.
+// Leaves reference contiguous ranges of `order`, which lists the input primitives in depth-first leaf order.
+class BvhBuilder {
+public:
+    // Relative cost of a node traversal step versus a single primitive intersection
+    static constexpr double traversal_cost = 0.125;
+    static constexpr size_t default_max_leaf_size = 4;
+    static constexpr int bin_count = 16;
+
+    // Past this depth splits switch to the object median, which bounds the depth of any tree to max_depth
+    // (primitive offsets are 32-bit) so traversal can use fixed-size stacks
+    static constexpr int sah_depth_limit = 64;
+    static constexpr int max_depth = sah_depth_limit + 32;
+
+    // Ranges smaller than these are not worth handing to another thread
+    static constexpr size_t parallel_task_threshold = 4096;
+    static constexpr size_t parallel_binning_threshold = 65536;
+
+    std::unique_ptr<BvhBuildNode> root;
+    std::vector<size_t> order; // Index into the input boxes of each primitive, in leaf order
+    BvhBuildStats stats;
+
+    // leaf_batch_width is the number of primitives a leaf intersects at once, so leaves are costed by the number
+    // of batches rather than the number of primitives
+    BvhBuilder(const std::vector<AABB>& boxes, unsigned int max_threads,
+               size_t _max_leaf_size = default_max_leaf_size, size_t _leaf_batch_width = 1)
+        : max_leaf_size(_max_leaf_size), leaf_batch_width(_leaf_batch_width) {
+        auto start_time = std::chrono::steady_clock::now();
+
+        // More threads than the hardware runs at once only add switching
+        auto hardware_threads = std::thread::hardware_concurrency();
+        stats.threads = std::max(1u, hardware_threads > 0 ? std::min(max_threads, hardware_threads) : max_threads);
+        idle_threads = static_cast<int>(stats.threads) - 1;
+
+        build_primitives.resize(boxes.size());
+        parallelChunks(boxes.size(), [&](unsigned int, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                build_primitives[i] = BuildPrimitive{boxes[i], boxes[i].centroid(), i};
+            }
+        });
+
+        root = build(0, build_primitives.size(), 0);
+
+        // Partitioning happened in place, so the final order of build_primitives is the leaf order
+        order.resize(build_primitives.size());
+        for (size_t i = 0; i < build_primitives.size(); ++i) {
+            order[i] = build_primitives[i].index;
+        }
+
+        build_primitives.clear();
+        build_primitives.shrink_to_fit();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        stats.build_seconds = elapsed.count();
+        stats.node_count = node_count;
+        stats.leaf_count = leaf_count;
+        stats.primitive_count = order.size();
+    }
+
+    static std::vector<AABB> boundingBoxes(const HittableList& list) {
+        std::vector<AABB> boxes;
+        boxes.reserve(list.objects.size());
+        for (const auto& object : list.objects) {
+            boxes.push_back(object->boundingBox());
+        }
+        return boxes;
+    }
+
+    // Returns items permuted into leaf order
+    template<typename T>
+    [[nodiscard]] std::vector<T> reorder(const std::vector<T>& items) const {
+        std::vector<T> ordered;
+        ordered.reserve(order.size());
+        for (auto index : order) {
+            ordered.push_back(items[index]);
+        }
+        return ordered;
+    }
+
+private:
+    struct BuildPrimitive {
+        AABB box;
+        Point3 centroid;
+        size_t index;
+    };
+
+    struct Bins {
+        AABB boxes[3][bin_count];
+        size_t counts[3][bin_count] = {};
+
+        void merge(const Bins& other) {
+            for (int a = 0; a < 3; ++a) {
+                for (int b = 0; b < bin_count; ++b) {
+                    boxes[a][b] = AABB(boxes[a][b], other.boxes[a][b]);
+                    counts[a][b] += other.counts[a][b];
+                }
+            }
+        }
+    };
+
+    struct Bounds {
+        AABB box;
+        AABB centroid_box;
+    };
+
+    size_t max_leaf_size;
+    size_t leaf_batch_width;
+
+    // Build state, released once construction finishes
+    std::vector<BuildPrimitive> build_primitives;
+    std::atomic<int> idle_threads{0}; // Helper threads that may still be started, shared by every task
+    std::atomic<size_t> node_count{0};
+    std::atomic<size_t> leaf_count{0};
+
+    // Most chunks parallelChunks splits a range of the given size into
+    [[nodiscard]] unsigned int chunkCount(size_t count) const {
+        return count < parallel_binning_threshold ? 1 : stats.threads;
+    }
+
+    // Runs fn(chunk, begin, end) over [0, count) split into contiguous chunks, one for the calling thread and one
+    // for each helper it can claim, up to chunkCount(count) in all. Chunk indices stay below chunkCount(count).
+    template<typename Fn>
+    void parallelChunks(size_t count, Fn&& fn) {
+        unsigned int n_chunks = 1 + claimThreads(chunkCount(count) - 1);
+        if (n_chunks <= 1) {
+            fn(0u, size_t(0), count);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for (unsigned int c = 1; c < n_chunks; ++c) {
+            workers.emplace_back(fn, c, c * count / n_chunks, (c + 1) * count / n_chunks);
+        }
+        fn(0u, size_t(0), count / n_chunks);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        idle_threads += static_cast<int>(n_chunks - 1);
+    }
+
+    // Folds fn(partial, i) over [start, end), splitting large ranges into one partial result per thread. Unused
+    // partial results stay default constructed, which merge() must treat as empty.
+    template<typename T, typename Fn, typename Merge>
+    T parallelReduce(size_t start, size_t end, Fn&& fn, Merge&& merge) {
+        auto count = end - start;
+        if (chunkCount(count) <= 1) {
+            T result;
+            for (size_t i = start; i < end; ++i) {
+                fn(result, i);
+            }
+            return result;
+        }
+
+        std::vector<T> partial(chunkCount(count));
+        parallelChunks(count, [&](unsigned int chunk, size_t begin, size_t finish) {
+            for (size_t i = start + begin; i < start + finish; ++i) {
+                fn(partial[chunk], i);
+            }
+        });
+
+        for (size_t c = 1; c < partial.size(); ++c) {
+            merge(partial[0], partial[c]);
+        }
+        return partial[0];
+    }
+
+    [[nodiscard]] double leafCost(size_t count) const {
+        return static_cast<double>((count + leaf_batch_width - 1) / leaf_batch_width);
+    }
+
+    Bounds computeBounds(size_t start, size_t end) {
+        return parallelReduce<Bounds>(start, end,
+            [&](Bounds& bounds, size_t i) {
+                const auto& prim = build_primitives[i];
+                bounds.box = AABB(bounds.box, prim.box);
+                bounds.centroid_box = AABB(bounds.centroid_box, AABB(prim.centroid, prim.centroid));
+            },
+            [](Bounds& into, const Bounds& other) {
+                into.box = AABB(into.box, other.box);
+                into.centroid_box = AABB(into.centroid_box, other.centroid_box);
+            });
+    }
+
+    static int binIndex(const AABB& centroid_box, const Point3& centroid, int axis) {
+        const auto& extent = centroid_box.axis(axis);
+        auto b = static_cast<int>(bin_count * ((centroid[axis] - extent.min) / extent.size()));
+        return std::clamp(b, 0, bin_count - 1);
+    }
+
+    Bins computeBins(size_t start, size_t end, const AABB& centroid_box) {
+        return parallelReduce<Bins>(start, end,
+            [&](Bins& bins, size_t i) {
+                const auto& prim = build_primitives[i];
+                for (int a = 0; a < 3; ++a) {
+                    if (centroid_box.axis(a).size() <= 0) {
+                        continue;
+                    }
+                    auto b = binIndex(centroid_box, prim.centroid, a);
+                    bins.boxes[a][b] = AABB(bins.boxes[a][b], prim.box);
+                    bins.counts[a][b]++;
+                }
+            },
+            [](Bins& into, const Bins& other) { into.merge(other); });
+    }
+
+    std::unique_ptr<BvhBuildNode> makeLeaf(size_t start, size_t end, const AABB& box) {
+        auto node = std::make_unique<BvhBuildNode>();
+        node->bbox = box;
+        node->first_primitive = start;
+        node->primitive_count = end - start;
+
+        ++node_count;
+        ++leaf_count;
+        return node;
+    }
+
+    std::unique_ptr<BvhBuildNode> build(size_t start, size_t end, int depth) {
+        auto count = end - start;
+        auto bounds = computeBounds(start, end);
+
+        if (count <= 1) {
+            return makeLeaf(start, end, bounds.box);
+        }
+
+        // Evaluate the SAH cost of every bin boundary on every axis with a prefix and suffix sweep
+        auto bins = computeBins(start, end, bounds.centroid_box);
+        auto parent_area = bounds.box.surfaceArea();
+        auto best_cost = infinity;
+        int best_axis = -1;
+        int best_bin = 0;
+
+        for (int a = 0; a < 3; ++a) {
+            if (bounds.centroid_box.axis(a).size() <= 0) {
+                continue;
+            }
+
+            double right_areas[bin_count];
+            size_t right_counts[bin_count];
+            AABB right_box;
+            size_t right_count = 0;
+            for (int b = bin_count - 1; b > 0; --b) {
+                right_box = AABB(right_box, bins.boxes[a][b]);
+                right_count += bins.counts[a][b];
+                right_areas[b] = right_box.surfaceArea();
+                right_counts[b] = right_count;
+            }
+
+            AABB left_box;
+            size_t left_count = 0;
+            for (int b = 1; b < bin_count; ++b) {
+                left_box = AABB(left_box, bins.boxes[a][b - 1]);
+                left_count += bins.counts[a][b - 1];
+                if (left_count == 0 || right_counts[b] == 0) {
+                    continue;
+                }
+
+                auto cost = traversal_cost + (left_box.surfaceArea() * leafCost(left_count)
+                                              + right_areas[b] * leafCost(right_counts[b])) / parent_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_bin = b;
+                }
+            }
+        }
+
+        size_t mid;
+        if (best_axis < 0) {
+            // Every centroid coincides, so no bin boundary can separate the primitives
+            if (count <= max_leaf_size) {
+                return makeLeaf(start, end, bounds.box);
+            }
+            best_axis = bounds.box.longestAxis();
+            mid = start + count / 2;
+        } else if (count <= max_leaf_size && best_cost >= leafCost(count)) {
+            return makeLeaf(start, end, bounds.box);
+        } else if (depth >= sah_depth_limit) {
+            best_axis = bounds.centroid_box.longestAxis();
+            mid = start + count / 2;
+            std::nth_element(build_primitives.begin() + start, build_primitives.begin() + mid,
+                             build_primitives.begin() + end,
+                             [&](const BuildPrimitive& a, const BuildPrimitive& b) {
+                                 return a.centroid[best_axis] < b.centroid[best_axis];
+                             });
+        } else {
+            auto split = std::partition(build_primitives.begin() + start, build_primitives.begin() + end,
+                                        [&](const BuildPrimitive& prim) {
+                                            return binIndex(bounds.centroid_box, prim.centroid, best_axis) < best_bin;
+                                        });
+            mid = split - build_primitives.begin();
+        }
+
+        auto node = std::make_unique<BvhBuildNode>();
+        node->bbox = bounds.box;
+        node->axis = best_axis;
+
+        // Hand the left subtree to an idle thread when it is large enough to be worth it
+        std::thread left_task;
+        if (mid - start >= parallel_task_threshold && claimThreads(1) == 1) {
+            left_task = std::thread([&]() {
+                node->children[0] = build(start, mid, depth + 1);
+                ++idle_threads;
+            });
+        } else {
+            node->children[0] = build(start, mid, depth + 1);
+        }
+
+        node->children[1] = build(mid, end, depth + 1);
+
+        if (left_task.joinable()) {
+            left_task.join();
+        }
+
+        ++node_count;
+        return node;
+    }
+
+    // Takes up to `wanted` helper threads from the shared budget, returning how many it got. They go back to the
+    // budget when the helpers finish.
+    unsigned int claimThreads(unsigned int wanted) {
+        auto available = idle_threads.load();
+        while (available > 0 && wanted > 0) {
+            auto taken = std::min(available, static_cast<int>(wanted));
+            if (idle_threads.compare_exchange_weak(available, available - taken)) {
+                return static_cast<unsigned int>(taken);
+            }
+        }
+        return 0;
+    }
+};
+
+// Binary hierarchy flattened into one contiguous array of 32-byte nodes in depth-first order, so the first child of
+// an interior node directly follows it and only the second child needs an offset. Leaves are handed back to the
+// owner through a callback, which lets the same nodes index hittables or any other primitive storage.
+class LinearBvh {
+public:
+    LinearBvh() {}
+
+    explicit LinearBvh(const BvhBuildNode& root) : LinearBvh(root, [](size_t first) { return first; }) {}
+
+    // leaf_offset maps the first primitive of each build leaf to the offset stored in the node
+    template<typename LeafOffset>
+    LinearBvh(const BvhBuildNode& root, LeafOffset&& leaf_offset) {
+        padding = floatBoxPadding(root.bbox);
+        if (!root.isLeaf() || root.primitive_count > 0) {
+            flatten(root, leaf_offset);
+        }
+    }
+
+    [[nodiscard]] size_t nodeCount() const { return nodes.size(); }
+
+    [[nodiscard]] size_t memoryBytes() const { return nodes.size() * sizeof(Node); }
+
+    // Calls leaf(offset, count, ray_t) for every leaf the ray reaches, near child first. The callback returns whether
+    // it found a hit and must then lower ray_t.max to it, which culls the remaining farther nodes. With AnyHit the
+    // traversal stops at the first leaf with a hit instead.
+    template<bool AnyHit = false, typename LeafFn>
+    bool traverse(const Ray& ray, Interval& ray_t, LeafFn&& leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+
+        float origin[3];
+        float inv_dir[3];
+        bool dir_is_neg[3];
+        for (int a = 0; a < 3; ++a) {
+            origin[a] = static_cast<float>(ray.origin()[a]);
+            inv_dir[a] = static_cast<float>(1.0 / ray.direction()[a]);
+            dir_is_neg[a] = std::signbit(inv_dir[a]);
+        }
+
+        uint32_t stack[BvhBuilder::max_depth];
+        int sp = 0;
+        uint32_t current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[current];
+            if (traversal_counters.enabled) {
+                traversal_counters.touch(&node, sizeof(Node));
+            }
+            if (node.hit(origin, inv_dir, dir_is_neg, static_cast<float>(ray_t.min), static_cast<float>(ray_t.max))) {
+                if (node.primitive_count > 0) {
+                    bool leaf_hit = leaf(node.offset, node.primitive_count, ray_t);
+                    if (AnyHit && leaf_hit) {
+                        return true;
+                    }
+                    hit_anything |= leaf_hit;
+                } else {
+                    // Visit the child on the near side of the split first so the far child can be culled by its hit
+                    if (dir_is_neg[node.axis]) {
+                        stack[sp++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[sp++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (sp == 0) {
+                break;
+            }
+            current = stack[--sp];
+        }
+
+        return hit_anything;
+    }
+
+private:
+    struct alignas(32) Node {
+        float bounds_min[3];
+        float bounds_max[3];
+        uint32_t offset; // First primitive for leaves, second child for interior nodes
+        uint16_t primitive_count; // 0 for interior nodes
+        uint8_t axis; // Split axis, interior nodes only
+        uint8_t pad;
+
+        bool hit(const float* origin, const float* inv_dir, const bool* dir_is_neg, float t_min, float t_max) const {
+            float t_enter = t_min;
+            float t_exit = t_max * far_scale;
+            for (int a = 0; a < 3; ++a) {
+                float t0 = ((dir_is_neg[a] ? bounds_max[a] : bounds_min[a]) - origin[a]) * inv_dir[a];
+                float t1 = ((dir_is_neg[a] ? bounds_min[a] : bounds_max[a]) - origin[a]) * inv_dir[a];
+                // NaNs from rays parallel to and inside a slab fail both comparisons and leave the interval unchanged
+                t_enter = t0 > t_enter ? t0 : t_enter;
+                t_exit = t1 < t_exit ? t1 : t_exit;
+            }
+            return t_enter <= t_exit;
+        }
+    };
+    static_assert(sizeof(Node) == 32, "BVH nodes should fill half a cache line");
+
+    static constexpr float far_scale = 1.0f + 1e-6f; // Absorbs float rounding of the exit distance
+
+    std::vector<Node> nodes;
+    double padding = 0;
+
+    template<typename LeafOffset>
+    uint32_t flatten(const BvhBuildNode& build_node, LeafOffset& leaf_offset) {
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        Node node{};
+        for (int a = 0; a < 3; ++a) {
+            node.bounds_min[a] = roundDownToFloat(build_node.bbox.axis(a).min - padding);
+            node.bounds_max[a] = roundUpToFloat(build_node.bbox.axis(a).max + padding);
+        }
+
+        if (build_node.isLeaf()) {
+            node.offset = static_cast<uint32_t>(leaf_offset(build_node.first_primitive));
+            node.primitive_count = static_cast<uint16_t>(build_node.primitive_count);
+        } else {
+            node.axis = static_cast<uint8_t>(build_node.axis);
+            flatten(*build_node.children[0], leaf_offset);
+            node.offset = flatten(*build_node.children[1], leaf_offset);
+        }
+
+        nodes[index] = node;
+        return index;
+    }
+};
+
+// Binary bounding volume hierarchy over a list of hittables, see BvhBuilder for how it is constructed
+class Bvh : public Hittable {
+public:
+    explicit Bvh(const HittableList& list, unsigned int max_threads = 1) {
+        BvhBuilder builder(BvhBuilder::boundingBoxes(list), max_threads);
+        auto start_time = std::chrono::steady_clock::now();
+
+        primitives = builder.reorder(list.objects);
+        bbox = builder.root->bbox;
+        hierarchy = LinearBvh(*builder.root);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        build_stats = builder.stats;
+        build_stats.build_seconds += elapsed.count();
+        build_stats.memory_bytes = hierarchy.memoryBytes() + primitives.size() * sizeof(primitives[0]);
+    }
+
+    bool hit(const Ray &ray, Interval ray_t, HitRecord& rec) const override {
+        return hierarchy.traverse(ray, ray_t, [&](uint32_t first, uint32_t count, Interval& leaf_t) {
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; ++i) {
+                if (primitives[i]->hit(ray, leaf_t, rec)) {
+                    hit_anything = true;
+                    leaf_t.max = rec.t;
+                }
+            }
+            return hit_anything;
+        });
+    }
+
+    bool occluded(const Ray &ray, Interval ray_t) const override {
+        return hierarchy.traverse<true>(ray, ray_t, [&](uint32_t first, uint32_t count, Interval& leaf_t) {
+            for (uint32_t i = first; i < first + count; ++i) {
+                if (primitives[i]->occluded(ray, leaf_t)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    void collectLights(const MaterialTable& materials, LightList& lights) const override {
+        for (const auto& primitive : primitives) {
+            primitive->collectLights(materials, lights);
+        }
+    }
+
+    AABB boundingBox() const override { return bbox; }
+
+    [[nodiscard]] const BvhBuildStats& stats() const { return build_stats; }
+
+private:
+    LinearBvh hierarchy;
+    std::vector<shared_ptr<Hittable>> primitives;
+    AABB bbox;
+    BvhBuildStats build_stats;
+};
+
+#endif //RAYTRACER_BVH_H
@@ -5,16 +5,29 @@
 #include <atomic>
 #include <mutex>
 #include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <functional>
 
+#include "bvh.h"
 #include "hittable.h"
+#include "light.h"
 #include "color.h"
+#include "environment.h"
 #include "material.h"
+#include "reservoir.h"
+#include "tile_scheduler.h"
+#include "wavefront.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 const int CHANNEL_NUM = 3;
 
+// How samples are computed: each path followed to its end before the next, many paths advanced one bounce at a
+// time, stage by stage (see Camera::sampleWavefront), or only the ambient occlusion of the surfaces camera rays hit
+enum class Integrator { Path, Wavefront, AmbientOcclusion };
+
 class Camera {
 public:
     double aspect_ratio = 1.0;
@@ -23,6 +36,7 @@ public:
     std::string imageName = "image.png";
     int samples_per_pixel = 10; // Number of random samples per pixel
     int max_depth = 10; // Maximum number of ray bounces
+    int roulette_min_depth = 3; // Bounces before Russian roulette may end a path, max_depth or more disables it
 
     double vfov = 90; // Degrees
     Point3 look_from = Point3(0, 0, -1); // Point camera is looking from
@@ -32,53 +46,128 @@ public:
     double defocus_angle = 0.0; // Variation angle of rays through each pixel (Degrees)
     double focus_distance = 1.0; // Distance from look_from point to focus plane
 
-    unsigned int max_threads = 10;
+    unsigned int max_threads = 10; // Set to 0 to use the hardware concurrency
+    int tile_size = 16; // Edge length in pixels of the square tiles handed out to render threads
+    int packet_size = 8; // Camera rays of a pixel traced together, up to max_ray_packet. 1 traces each alone.
 
-    void render(const Hittable &world) {
-        initialize();
+    Integrator integrator = Integrator::Path;
+    int wave_size = 1024; // Paths the wavefront integrator carries at once
+    bool bin_secondary_rays = false; // Wavefront only: trace each bounce's rays sorted by origin and direction
+    // Wavefront only: scattered rays a render thread keeps in flight, switching between them on every node fetch,
+    // up to max_ray_packet. 1 traces each alone.
+    int rays_in_flight = 1;
+    double ao_distance = 1.0; // Ambient occlusion only: occluders farther from the surface than this do not count
+    // Run the node and leaf batch reads of secondary rays through a software model of an L1 cache (see
+    // TraversalCounters) and report how many nodes a ray reads and how many cache lines miss. Slows rendering down.
+    bool simulate_cache = false;
 
-        const unsigned int n_threads = max_threads;
-        std::vector<std::thread> threads(n_threads);
+    // Adaptive sampling stops a pixel once the standard error of its displayed value (0 to 1) falls below the
+    // threshold, and spends the samples saved on the noisiest pixels of the same tile. samples_per_pixel becomes
+    // the average budget. Set to 0 to take exactly samples_per_pixel samples everywhere.
+    double adaptive_threshold = 0;
+    int adaptive_min_samples = 32; // Samples every pixel takes before its error is trusted
 
-        std::vector<unsigned char> pixels(image_height*image_width*CHANNEL_NUM);
+    // Next event estimation: every hit on a diffuse surface is connected to a point on a light by a shadow ray, and
+    // the light found that way and the light found by scattering are combined by multiple importance sampling.
+    // Without it lights are only found by scattering into them.
+    bool sample_lights = true;
+    LightSampling light_sampling = LightSampling::Power; // How next event estimation picks one of many lights
+    double sky_brightness = 1.0; // Scale of the sky gradient, 0 for a scene lit by its lights alone
+    // Light from beyond the scene in place of the sky gradient, also scaled by sky_brightness. Next event estimation
+    // samples it like a light, picking it for half of the connections when the scene has lights of its own.
+    shared_ptr<const EnvironmentMap> environment;
 
-        volatile std::atomic<int> completed(0);
-        std::mutex cout_lock;
+    // Reservoir resampling of the direct light at the surfaces camera rays hit (ReSTIR). Every pass takes one sample
+    // per pixel: each pixel resamples its own light candidates, then with temporal_resampling the reservoir its
+    // surface had at the end of the previous frame, and those of a few neighbouring pixels, so that the light sample
+    // it shades with was chosen among many. Passes of the same frame do not reuse each other's reservoirs, but every
+    // pass merges the same one from the previous frame, so that one weighs 1/samples_per_pixel of a full merge in
+    // each and the frame as a whole takes it in once. Only used with Integrator::Path, where it replaces tiled
+    // rendering, adaptive sampling and next event estimation at the first hit. Set resampling_candidates to 0 to
+    // disable it.
+    int resampling_candidates = 0; // Light samples each pixel draws per pass
+    int resampling_neighbors = 4; // Pixels whose reservoirs are reused in every pass
+    int resampling_radius = 16; // In pixels, of the disk the neighbours are drawn from
+    // Keep each pixel's last reservoir for the next render() of an animation to reuse. Costs a buffer the size of the
+    // image, so only worth it when frames follow.
+    bool temporal_resampling = false;
 
-        for (int t = 0; t < n_threads; ++t) {
-            threads[t] = std::thread([&](int start, int end, int t) {
-                for (int j = start; j < end; ++j) {
-                    for (int i = 0; i < image_width; ++i) {
-                        Color pixel_color(0, 0, 0);
-                        for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                            Ray r = getRay(i, j);
-                            pixel_color += rayColor(r, max_depth, world);
-                        }
+    SamplerType sampler_type = SamplerType::Sobol; // Where pixel, lens and bounce samples come from
+    uint32_t frame = 0; // Decorrelates the samples of successive frames of an animation
 
-                        writeColor(pixels, 3*(j*image_width+i), pixel_color, samples_per_pixel);
-                    }
+    // Number of worker threads render will use for the current max_threads setting
+    [[nodiscard]] unsigned int threadCount() const {
+        return max_threads < 1 ? std::thread::hardware_concurrency() : max_threads;
+    }
 
-                    completed++;
-                    {  //lock variable scope
-                        cout_lock.lock();
-                        std::cout << "\rProgress: [ "<< std::fixed << std::setprecision(2) << (((float)completed / (float)image_height)) * 100.0 << "% ]    " << std::flush;
-                        std::cout.flush();
-                        cout_lock.unlock();
-                    }
-                }
-            }, t*image_height/n_threads, (t + 1)==n_threads ? image_height : (t+1)*image_height/n_threads, t);
-        }
+    void render(const Hittable &world, const MaterialTable& materials) {
+        initialize();
+        material_types = materials.typeIndices();
+        material_type_count = material_types.empty() ? 0
+                              : *std::max_element(material_types.begin(), material_types.end()) + 1;
+        lights = LightList();
+        world.collectLights(materials, lights);
+        lights.build(light_sampling);
 
-        for (int t = 0; t < n_threads; ++t) {
-            threads[t].join();
+        std::vector<unsigned char> pixels(image_height*image_width*CHANNEL_NUM);
+        std::atomic<uint64_t> total_samples(0);
+        TraceStats total_stats;
+        auto start_time = std::chrono::steady_clock::now();
+
+        if (resampling_candidates > 0 && integrator == Integrator::Path && sample_lights && !lights.empty()) {
+            renderResampled(world, materials, pixels, total_stats);
+            total_samples = static_cast<uint64_t>(image_width) * image_height * samples_per_pixel;
+        } else {
+            history.clear();
+            history.shrink_to_fit();
+            renderTiles(world, materials, pixels, total_samples, total_stats);
         }
 
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
         stbi_write_png(imageName.c_str(), image_width, image_height, CHANNEL_NUM, pixels.data(), image_width * CHANNEL_NUM);
 
+        auto total_rays = total_stats.primary_rays + total_stats.secondary_rays;
         std::cout << "\rDone.                    \n";
+        std::cout << "Rendered in " << std::fixed << std::setprecision(2) << elapsed.count() << "s ("
+                  << total_rays << " rays, " << total_rays / elapsed.count() / 1e6 << " Mrays/s, "
+                  << static_cast<double>(total_samples) / (image_width * image_height) << " samples/pixel)\n";
+        std::cout << "Per thread: " << total_stats.primary_rays / total_stats.primary_seconds / 1e6
+                  << " Mrays/s for camera rays in packets of " << std::clamp(packet_size, 1, max_ray_packet) << ", "
+                  << total_stats.secondary_rays / total_stats.secondary_seconds / 1e6
+                  << " Mrays/s for secondary rays including shading\n";
+        if (simulate_cache && total_stats.secondary_rays > 0 && total_stats.line_reads > 0) {
+            std::cout << "Secondary rays read "
+                      << static_cast<double>(total_stats.node_fetches) / total_stats.secondary_rays
+                      << " nodes and leaf batches each, missing "
+                      << 100.0 * total_stats.line_misses / total_stats.line_reads
+                      << "% of their cache lines in a simulated 32 KiB cache\n";
+        }
     }
 
 private:
+    // Rays traced by a render thread and the time spent on them
+    struct TraceStats {
+        uint64_t primary_rays = 0;
+        uint64_t secondary_rays = 0;
+        double primary_seconds = 0; // Generating and tracing camera rays
+        double secondary_seconds = 0; // Shading every hit and tracing the rays after the first
+        uint64_t node_fetches = 0; // Of the secondary rays, see TraversalCounters
+        uint64_t line_reads = 0;
+        uint64_t line_misses = 0;
+
+        TraceStats& operator+=(const TraceStats& other) {
+            primary_rays += other.primary_rays;
+            secondary_rays += other.secondary_rays;
+            primary_seconds += other.primary_seconds;
+            secondary_seconds += other.secondary_seconds;
+            node_fetches += other.node_fetches;
+            line_reads += other.line_reads;
+            line_misses += other.line_misses;
+            return *this;
+        }
+    };
+
     Point3 center;
     Point3 pixel00_loc; // Location of the upper left pixel (0, 0)
     Vec3 pixel_delta_u; // Offset to next horizontal pixel
@@ -86,6 +175,43 @@ private:
     Vec3 u, v, w; // Camera basis vectors
     Vec3 defocus_disk_u; // Defocus disk horizontal radius
     Vec3 defocus_disk_v; // Defocus disk vertical radius
+    std::vector<uint32_t> material_types; // See MaterialTable::typeIndices()
+    size_t material_type_count = 0;
+    LightList lights;
+
+    // Camera ray of a pixel in a resampling pass, its first hit and the reservoir of light samples at the hit
+    struct ResampledPixel {
+        Ray ray;
+        HitRecord record;
+        bool hit = false;
+        Real depth = 0; // Distance of the hit from the camera center, to tell whether two pixels see alike surfaces
+        LightReservoir reservoir;
+    };
+
+    // Where the camera was in the frame whose pixels make up the history, to find the pixel that saw a point then
+    struct CameraPlacement {
+        Point3 center;
+        Point3 pixel00_loc;
+        Vec3 pixel_delta_u, pixel_delta_v;
+        Vec3 w;
+        double focus_distance = 1;
+    };
+
+    // What temporal reuse keeps of a pixel's reservoir after the last pass of a frame: enough of its surface to
+    // evaluate the target function and trace shadow rays there. The camera ray is rebuilt from history_camera.
+    struct HistoryPixel {
+        LightReservoir reservoir;
+        Point3 point;
+        Vec3 normal; // Facing the camera
+        Real point_error;
+        MaterialId material;
+        bool hit = false;
+    };
+
+    // The pixels of the previous frame, which every pass of the current one reuses
+    std::vector<HistoryPixel> history;
+    CameraPlacement history_camera;
+    int history_width = 0, history_height = 0;
 
     void initialize() {
         if (image_height == 0) {
@@ -93,9 +219,7 @@ private:
         }
         image_height = (image_height < 1) ? 1 : image_height;
 
-        if (max_threads < 1) {
-            max_threads = std::thread::hardware_concurrency();
-        }
+        max_threads = threadCount();
 
         center = look_from;
 
@@ -128,49 +252,995 @@ private:
         defocus_disk_v = defocus_radius * v;
     }
 
-    Ray getRay(int i, int j) const {
+    // Running estimate of a pixel for adaptive sampling
+    struct PixelEstimate {
+        ColorSum sum;
+        ColorSum squares;
+        int samples = 0;
+
+        void add(const Color& color) {
+            ColorSum sample(color);
+            sum += sample;
+            squares += sample * sample;
+            ++samples;
+        }
+
+        // Standard error of the gamma corrected value of the worst channel, propagated from the error of its mean
+        [[nodiscard]] double error() const {
+            double worst = 0;
+            for (int c = 0; c < 3; ++c) {
+                auto mean = sum[c] / samples;
+                auto variance = std::max(0.0, (squares[c] - sum[c] * mean) / (samples - 1));
+                worst = std::max(worst, std::sqrt(variance / samples) / (2 * std::sqrt(std::max(mean, 1e-4))));
+            }
+            return worst;
+        }
+    };
+
+    static constexpr int adaptive_batch = 8; // Samples an unconverged pixel takes per round
+
+    // Samples [first, first + count) of pixel (x, y)
+    struct SampleRange {
+        int x, y;
+        int first, count;
+    };
+
+    // Renders the image tile by tile with the selected integrator, each thread taking the next tile of the scheduler
+    void renderTiles(const Hittable& world, const MaterialTable& materials, std::vector<unsigned char>& pixels,
+                     std::atomic<uint64_t>& total_samples, TraceStats& total_stats) const {
+        const unsigned int n_threads = max_threads;
+        std::vector<std::thread> threads(n_threads);
+
+        volatile std::atomic<int> completed(0);
+        std::mutex cout_lock;
+
+        TileScheduler scheduler(image_width, image_height, tile_size, n_threads);
+
+        for (unsigned int t = 0; t < n_threads; ++t) {
+            threads[t] = std::thread([&](unsigned int t) {
+                TraceStats stats;
+                traversal_counters = TraversalCounters();
+                traversal_counters.enabled = simulate_cache;
+                uint64_t samples = 0;
+                auto sampler = makeSampler(sampler_type, frame);
+                Tile tile;
+                while (scheduler.next(t, tile)) {
+                    if (adaptive_threshold > 0) {
+                        samples += renderTileAdaptive(tile, world, materials, *sampler, pixels, stats);
+                    } else {
+                        samples += renderTile(tile, world, materials, *sampler, pixels, stats);
+                    }
+
+                    completed++;
+                    {  //lock variable scope
+                        cout_lock.lock();
+                        std::cout << "\rProgress: [ "<< std::fixed << std::setprecision(2) << (((float)completed / (float)scheduler.tileCount())) * 100.0 << "% ]    " << std::flush;
+                        std::cout.flush();
+                        cout_lock.unlock();
+                    }
+                }
+                total_samples += samples;
+                traversal_counters.enabled = false;
+                stats.node_fetches = traversal_counters.node_fetches;
+                stats.line_reads = traversal_counters.line_reads;
+                stats.line_misses = traversal_counters.line_misses;
+                std::lock_guard<std::mutex> lock(cout_lock);
+                total_stats += stats;
+            }, t);
+        }
+
+        for (unsigned int t = 0; t < n_threads; ++t) {
+            threads[t].join();
+        }
+    }
+
+    // Renders samples_per_pixel resampling passes over the whole image. The first stage of a pass traces the camera
+    // rays, draws each pixel's candidates and reuses its reservoir from the previous frame, then the second reuses the
+    // neighbours' reservoirs and shades, so every pixel's reservoir is complete before any neighbour reads it. The
+    // render threads live for all the passes, taking rows of a stage one at a time and waiting for each other at the
+    // end of every stage.
+    void renderResampled(const Hittable& world, const MaterialTable& materials, std::vector<unsigned char>& pixels,
+                         TraceStats& total_stats) {
+        auto pixel_count = static_cast<size_t>(image_width) * image_height;
+        std::vector<ColorSum> pixel_colors(pixel_count);
+        std::vector<ResampledPixel> current(pixel_count), reused(pixel_count);
+        if (!temporal_resampling || history_width != image_width || history_height != image_height) {
+            history.clear();
+            history.shrink_to_fit();
+        }
+        auto packet = std::clamp(packet_size, 1, max_ray_packet);
+
+        auto trace_row = [&](int j, int s, Sampler& sampler, TraceStats& stats) {
+            auto start_time = std::chrono::steady_clock::now();
+            Ray rays[max_ray_packet];
+            Interval ray_t[max_ray_packet];
+            HitRecord records[max_ray_packet];
+            for (int start = 0; start < image_width; start += packet) {
+                auto n = std::min(packet, image_width - start);
+                for (int k = 0; k < n; ++k) {
+                    sampler.startSample(start + k, j, s);
+                    rays[k] = getRay(start + k, j, sampler);
+                    ray_t[k] = Interval(0, infinity);
+                }
+                uint32_t hits = traceCameraRays(world, rays, n, ray_t, records);
+                for (int k = 0; k < n; ++k) {
+                    auto& pixel = current[j * image_width + start + k];
+                    pixel.ray = rays[k];
+                    pixel.record = records[k];
+                    pixel.hit = (hits >> k) & 1;
+                }
+            }
+            stats.primary_rays += image_width;
+            auto traced_time = std::chrono::steady_clock::now();
+
+            for (int i = 0; i < image_width; ++i) {
+                auto& pixel = current[j * image_width + i];
+                pixel.reservoir = LightReservoir();
+                if (!pixel.hit) {
+                    continue;
+                }
+                pixel.record.object->finalizeHit(pixel.ray, pixel.record);
+                pixel.depth = (pixel.record.point - center).length();
+                sampler.startSample(i, j, s);
+                sampleCandidates(pixel, materials, sampler);
+                if (!history.empty()) {
+                    reusePrevious(pixel, world, materials, sampler, stats);
+                }
+                dropOccluded(pixel, world, stats);
+            }
+
+            std::chrono::duration<double> primary = traced_time - start_time;
+            std::chrono::duration<double> secondary = std::chrono::steady_clock::now() - traced_time;
+            stats.primary_seconds += primary.count();
+            stats.secondary_seconds += secondary.count();
+        };
+
+        auto shade_row = [&](int j, int s, Sampler& sampler, TraceStats& stats) {
+            auto start_time = std::chrono::steady_clock::now();
+            for (int i = 0; i < image_width; ++i) {
+                auto index = j * image_width + i;
+                auto& pixel = reused[index];
+                pixel = current[index];
+                sampler.startSample(i, j, s);
+                Color light(0, 0, 0);
+                if (pixel.hit) {
+                    reuseNeighbors(i, j, current, pixel, world, materials, sampler, stats);
+                    light = shadeReservoir(pixel, world, materials, stats);
+                }
+                pixel_colors[index] += ColorSum(rayColor(pixel.ray, pixel.hit, pixel.record, world, materials,
+                                                         sampler, stats, &light));
+            }
+            std::chrono::duration<double> secondary = std::chrono::steady_clock::now() - start_time;
+            stats.secondary_seconds += secondary.count();
+        };
+
+        std::atomic<int> next_row(0);
+        StageBarrier barrier(max_threads);
+        std::mutex stats_lock;
+        std::vector<std::thread> threads(max_threads);
+        for (auto& thread : threads) {
+            thread = std::thread([&] {
+                TraceStats stats;
+                traversal_counters = TraversalCounters();
+                traversal_counters.enabled = simulate_cache;
+                auto sampler = makeSampler(sampler_type, frame);
+                for (int s = 0; s < samples_per_pixel; ++s) {
+                    for (int j = next_row++; j < image_height; j = next_row++) {
+                        trace_row(j, s, *sampler, stats);
+                    }
+                    barrier.arriveAndWait([&] { next_row = 0; });
+
+                    for (int j = next_row++; j < image_height; j = next_row++) {
+                        shade_row(j, s, *sampler, stats);
+                    }
+                    barrier.arriveAndWait([&] {
+                        next_row = 0;
+                        std::cout << "\rProgress: [ " << std::fixed << std::setprecision(2)
+                                  << 100.0 * (s + 1) / samples_per_pixel << "% ]    " << std::flush;
+                    });
+                }
+                traversal_counters.enabled = false;
+                stats.node_fetches = traversal_counters.node_fetches;
+                stats.line_reads = traversal_counters.line_reads;
+                stats.line_misses = traversal_counters.line_misses;
+                std::lock_guard<std::mutex> lock(stats_lock);
+                total_stats += stats;
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        // Only read by the next frame, so kept once the passes are done
+        if (temporal_resampling) {
+            history.resize(pixel_count);
+            for (size_t p = 0; p < pixel_count; ++p) {
+                const auto& pixel = reused[p];
+                history[p] = HistoryPixel{pixel.reservoir, pixel.record.point, pixel.record.normal,
+                                          pixel.record.point_error, pixel.record.material, pixel.hit};
+            }
+            history_camera = CameraPlacement{center, pixel00_loc, pixel_delta_u, pixel_delta_v, w, focus_distance};
+            history_width = image_width;
+            history_height = image_height;
+        }
+
+        for (size_t p = 0; p < pixel_count; ++p) {
+            writeColor(pixels, static_cast<int>(3 * p), pixel_colors[p], samples_per_pixel);
+        }
+    }
+
+    // Target function of light resampling: the brightness of the light that a candidate sends to a pixel's surface,
+    // per unit area of the light and without regard to visibility. Also returns that light in `contribution`.
+    Real lightTarget(const ResampledPixel& pixel, const LightCandidate& candidate, const MaterialTable& materials,
+                     Color& contribution) const {
+        Vec3 to_light = candidate.point - pixel.record.point;
+        auto distance_squared = to_light.lengthSquared();
+        if (!(distance_squared > 0)) {
+            return 0;
+        }
+        auto direction = to_light / sqrt(distance_squared);
+        auto cos_light = -dot(candidate.normal, direction);
+        if (!(cos_light > 0)) {
+            return 0;
+        }
+        auto bsdf = materials[pixel.record.material].evaluate(pixel.ray, pixel.record, direction);
+        contribution = bsdf * candidate.radiance * (cos_light / distance_squared);
+        return averageChannel(contribution);
+    }
+
+    Real lightTarget(const ResampledPixel& pixel, const LightCandidate& candidate,
+                     const MaterialTable& materials) const {
+        Color contribution;
+        return lightTarget(pixel, candidate, materials, contribution);
+    }
+
+    // Fills a pixel's reservoir with resampling_candidates light samples picked as next event estimation picks them
+    void sampleCandidates(ResampledPixel& pixel, const MaterialTable& materials, Sampler& sampler) const {
+        auto& reservoir = pixel.reservoir;
+        const auto& point = pixel.record.point;
+        for (int k = 0; k < resampling_candidates; ++k) {
+            sampler.setDimension(resampling_dimension + candidate_dimensions * k);
+            Real pick_probability;
+            const auto& light = lights[lights.pick(point, sampler.get1D(), pick_probability)];
+            auto u = sampler.get2D();
+            auto choice = sampler.get1D();
+            LightSample sample;
+            if (!light.sample(point, u.u, u.v, sample)) {
+                continue;
+            }
+
+            // Density per unit area of the light, from the density per solid angle at the surface
+            auto cos_light = -dot(sample.normal, sample.direction);
+            auto density = pick_probability * sample.pdf * cos_light / (sample.distance * sample.distance);
+            LightCandidate candidate{point + sample.distance * sample.direction, sample.normal, sample.radiance};
+            auto target = lightTarget(pixel, candidate, materials);
+            if (density > 0) {
+                reservoir.update(candidate, target, target / density, choice);
+            }
+        }
+        reservoir.count = resampling_candidates;
+        reservoir.finalize(reservoir.count);
+    }
+
+    // Empties a pixel's reservoir if its surface cannot see the sample kept, so that occluded samples do not spread
+    // to the neighbours. Every reservoir another pixel reads has been through this, and combineReservoirs() relies
+    // on it.
+    void dropOccluded(ResampledPixel& pixel, const Hittable& world, TraceStats& stats) const {
+        if (!pixel.reservoir.empty() && !visible(pixel, pixel.reservoir.sample, world, stats)) {
+            pixel.reservoir.contribution_weight = 0;
+        }
+    }
+
+    // Merges into a pixel's reservoir the one that the pixel seeing the same point had at the end of the previous
+    // frame, found by projecting the point through the camera of that frame. The history may stand for at most 20
+    // times the candidates of a pass, so that it keeps giving way to new samples, and is split evenly between the
+    // passes of the frame, which all merge it, so that their correlated picks do not count it samples_per_pixel times.
+    void reusePrevious(ResampledPixel& pixel, const Hittable& world, const MaterialTable& materials,
+                       Sampler& sampler, TraceStats& stats) const {
+        const auto& camera = history_camera;
+        Vec3 offset = pixel.record.point - camera.center;
+        auto depth = -dot(offset, camera.w);
+        if (!(depth > 0)) {
+            return;
+        }
+        Vec3 on_viewport = camera.center + offset * (camera.focus_distance / depth) - camera.pixel00_loc;
+        auto i = static_cast<int>(std::floor(dot(on_viewport, camera.pixel_delta_u)
+                                             / camera.pixel_delta_u.lengthSquared() + Real(0.5)));
+        auto j = static_cast<int>(std::floor(dot(on_viewport, camera.pixel_delta_v)
+                                             / camera.pixel_delta_v.lengthSquared() + Real(0.5)));
+        if (i < 0 || i >= history_width || j < 0 || j >= history_height) {
+            return;
+        }
+
+        const auto& kept = history[j * history_width + i];
+        if (!kept.hit) {
+            return;
+        }
+        ResampledPixel previous;
+        previous.ray = Ray(camera.center, kept.point - camera.center);
+        previous.record.point = kept.point;
+        previous.record.point_error = kept.point_error;
+        previous.record.normal = kept.normal;
+        previous.record.material = kept.material;
+        previous.record.front_face = true;
+        previous.hit = true;
+        previous.depth = (kept.point - camera.center).length();
+        previous.reservoir = kept.reservoir;
+        if (!similarSurfaces(pixel, previous)) {
+            return;
+        }
+        previous.reservoir.count = std::min<Real>(previous.reservoir.count, 20 * resampling_candidates)
+                                   / samples_per_pixel;
+
+        const ResampledPixel* sources[] = {&pixel, &previous};
+        sampler.setDimension(resampling_dimension + candidate_dimensions * resampling_candidates);
+        pixel.reservoir = combineReservoirs(pixel, sources, 2, world, materials, sampler, stats);
+    }
+
+    // Merges into a pixel's reservoir those of up to resampling_neighbors pixels drawn from a disk around it, skipping
+    // the ones that see a differently oriented or distant surface
+    void reuseNeighbors(int i, int j, const std::vector<ResampledPixel>& pixels, ResampledPixel& pixel,
+                        const Hittable& world, const MaterialTable& materials, Sampler& sampler,
+                        TraceStats& stats) const {
+        const ResampledPixel* sources[1 + max_resampling_neighbors];
+        int source_count = 0;
+        sources[source_count++] = &pixel;
+        auto neighbors = std::clamp(resampling_neighbors, 0, max_resampling_neighbors);
+        sampler.setDimension(resampling_dimension + candidate_dimensions * resampling_candidates + 2);
+        for (int n = 0; n < neighbors; ++n) {
+            auto u = sampler.get2D();
+            auto offset = sampleUnitDisk(u.u, u.v) * resampling_radius;
+            auto x = i + static_cast<int>(std::lround(offset.x()));
+            auto y = j + static_cast<int>(std::lround(offset.y()));
+            if ((x == i && y == j) || x < 0 || x >= image_width || y < 0 || y >= image_height) {
+                continue;
+            }
+            const auto& neighbor = pixels[y * image_width + x];
+            if (neighbor.hit && similarSurfaces(pixel, neighbor)) {
+                sources[source_count++] = &neighbor;
+            }
+        }
+        pixel.reservoir = combineReservoirs(pixel, sources, source_count, world, materials, sampler, stats);
+    }
+
+    // Resamples the reservoirs of sources, the first of which is the pixel itself, into one for the pixel. Each kept
+    // sample is reweighed by its target at this pixel, and the result is normalized by the candidates of the sources
+    // that could have produced the sample chosen, which keeps it unbiased. Since the other sources have dropped the
+    // samples they cannot see, that takes a shadow ray from each of their surfaces to the sample.
+    LightReservoir combineReservoirs(const ResampledPixel& pixel, const ResampledPixel* const* sources, int count,
+                                     const Hittable& world, const MaterialTable& materials, Sampler& sampler,
+                                     TraceStats& stats) const {
+        LightReservoir combined;
+        for (int s = 0; s < count; ++s) {
+            const auto& reservoir = sources[s]->reservoir;
+            auto choice = sampler.get1D();
+            if (!reservoir.empty()) {
+                auto target = s == 0 ? reservoir.target : lightTarget(pixel, reservoir.sample, materials);
+                combined.update(reservoir.sample, target, target * reservoir.contribution_weight * reservoir.count,
+                                choice);
+            }
+            combined.count += reservoir.count;
+        }
+
+        // The pixel's own reservoir either has not been through dropOccluded() yet, or is only shaded if its shadow
+        // ray reaches the sample, so its visibility never needs testing here
+        Real support = combined.target > 0 ? sources[0]->reservoir.count : 0;
+        for (int s = 1; s < count && combined.target > 0; ++s) {
+            if (lightTarget(*sources[s], combined.sample, materials) > 0
+                && visible(*sources[s], combined.sample, world, stats)) {
+                support += sources[s]->reservoir.count;
+            }
+        }
+        combined.finalize(support);
+        return combined;
+    }
+
+    // Whether two pixels see surfaces close enough in orientation and distance to share light samples
+    static bool similarSurfaces(const ResampledPixel& a, const ResampledPixel& b) {
+        return dot(a.record.normal, b.record.normal) > Real(0.9) && fabs(a.depth - b.depth) < Real(0.1) * a.depth;
+    }
+
+    // Shadow ray from a pixel's surface to a light candidate, with the t up to which it must be unblocked
+    static void shadowRay(const ResampledPixel& pixel, const LightCandidate& candidate, Ray& shadow,
+                          Real& shadow_t_max) {
+        auto origin = pixel.record.spawnRay(candidate.point - pixel.record.point).origin();
+        shadow = Ray(origin, candidate.point - origin);
+        shadow_t_max = 1 - shadow_ray_margin;
+    }
+
+    bool visible(const ResampledPixel& pixel, const LightCandidate& candidate, const Hittable& world,
+                 TraceStats& stats) const {
+        ++stats.secondary_rays;
+        Ray shadow;
+        Real shadow_t_max;
+        shadowRay(pixel, candidate, shadow, shadow_t_max);
+        return !world.occluded(shadow, Interval(0, shadow_t_max));
+    }
+
+    // Direct light at a pixel's surface estimated from its final reservoir, after a shadow ray to the sample kept.
+    // The reservoir is emptied if the sample is blocked, as dropOccluded() would, before it may become history.
+    Color shadeReservoir(ResampledPixel& pixel, const Hittable& world, const MaterialTable& materials,
+                         TraceStats& stats) const {
+        auto& reservoir = pixel.reservoir;
+        Color contribution;
+        if (reservoir.empty() || !(lightTarget(pixel, reservoir.sample, materials, contribution) > 0)) {
+            return Color(0, 0, 0);
+        }
+        if (!visible(pixel, reservoir.sample, world, stats)) {
+            reservoir.contribution_weight = 0;
+            return Color(0, 0, 0);
+        }
+        return contribution * reservoir.contribution_weight;
+    }
+
+    // Renders a tile with samples_per_pixel samples in every pixel, returning the number of samples taken
+    uint64_t renderTile(const Tile& tile, const Hittable& world, const MaterialTable& materials, Sampler& sampler,
+                        std::vector<unsigned char>& pixels, TraceStats& stats) const {
+        std::vector<SampleRange> ranges;
+        for (int j = tile.y0; j < tile.y1; ++j) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                ranges.push_back(SampleRange{i, j, 0, samples_per_pixel});
+            }
+        }
+
+        std::vector<ColorSum> pixel_colors(ranges.size());
+        sampleRanges(ranges, world, materials, sampler, stats, [&](size_t r, const Color& color) {
+            pixel_colors[r] += ColorSum(color);
+        });
+
+        for (size_t r = 0; r < ranges.size(); ++r) {
+            writeColor(pixels, 3*(ranges[r].y*image_width + ranges[r].x), pixel_colors[r], samples_per_pixel);
+        }
+
+        return static_cast<uint64_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samples_per_pixel;
+    }
+
+    // Renders a tile with a budget of samples_per_pixel samples per pixel on average. After adaptive_min_samples
+    // everywhere, rounds hand a batch to every pixel still above adaptive_threshold, noisiest first, until all pixels
+    // converge or the budget runs out.
+    uint64_t renderTileAdaptive(const Tile& tile, const Hittable& world, const MaterialTable& materials,
+                                Sampler& sampler, std::vector<unsigned char>& pixels, TraceStats& stats) const {
+        auto tile_width = tile.x1 - tile.x0;
+        auto pixel_count = tile_width * (tile.y1 - tile.y0);
+        std::vector<PixelEstimate> estimates(pixel_count);
+
+        // Pixels sampled in the current round, each taking its next samples
+        std::vector<int> round_pixels;
+        std::vector<SampleRange> ranges;
+        auto addRange = [&](int p, int count) {
+            round_pixels.push_back(p);
+            ranges.push_back(SampleRange{tile.x0 + p % tile_width, tile.y0 + p / tile_width, estimates[p].samples,
+                                         count});
+        };
+        auto sampleRound = [&]() {
+            sampleRanges(ranges, world, materials, sampler, stats, [&](size_t r, const Color& color) {
+                estimates[round_pixels[r]].add(color);
+            });
+            round_pixels.clear();
+            ranges.clear();
+        };
+
+        int64_t budget = static_cast<int64_t>(pixel_count) * samples_per_pixel;
+        auto min_samples = static_cast<int>(std::min<int64_t>(std::max(adaptive_min_samples, 2), samples_per_pixel));
+        for (int p = 0; p < pixel_count; ++p) {
+            addRange(p, min_samples);
+            budget -= min_samples;
+        }
+        sampleRound();
+
+        std::vector<std::pair<double, int>> unconverged;
+        while (budget > 0) {
+            unconverged.clear();
+            for (int p = 0; p < pixel_count; ++p) {
+                auto error = estimates[p].error();
+                if (error > adaptive_threshold) {
+                    unconverged.emplace_back(error, p);
+                }
+            }
+            if (unconverged.empty()) {
+                break;
+            }
+
+            std::sort(unconverged.begin(), unconverged.end(), std::greater<>());
+            for (const auto& [error, p] : unconverged) {
+                auto count = static_cast<int>(std::min<int64_t>(adaptive_batch, budget));
+                addRange(p, count);
+                budget -= count;
+                if (budget <= 0) {
+                    break;
+                }
+            }
+            sampleRound();
+        }
+
+        uint64_t samples = 0;
+        for (int p = 0; p < pixel_count; ++p) {
+            auto index = 3*((tile.y0 + p / tile_width)*image_width + tile.x0 + p % tile_width);
+            writeColor(pixels, index, estimates[p].sum, estimates[p].samples);
+            samples += estimates[p].samples;
+        }
+        return samples;
+    }
+
+    // Takes the samples of every range with the selected integrator and passes their colors to add(range index,
+    // color), in order within each range. Samples depend only on the pixel and index, so the image is the same for
+    // any integrator, thread count or packet size.
+    template<typename Add>
+    void sampleRanges(const std::vector<SampleRange>& ranges, const Hittable& world, const MaterialTable& materials,
+                      Sampler& sampler, TraceStats& stats, Add&& add) const {
+        if (integrator == Integrator::Wavefront) {
+            sampleWavefront(ranges, world, materials, sampler, stats, add);
+            return;
+        }
+
+        for (size_t r = 0; r < ranges.size(); ++r) {
+            const auto& range = ranges[r];
+            samplePixel(range.x, range.y, range.first, range.count, world, materials, sampler, stats,
+                        [&](const Color& color) { add(r, color); });
+        }
+    }
+
+    // Takes `count` samples of pixel (i, j) from sample index `first` on and passes their colors to add, in order.
+    // The camera rays go through the scene in packets of packet_size, then each path continues on its own.
+    template<typename Add>
+    void samplePixel(int i, int j, int first, int count, const Hittable& world, const MaterialTable& materials,
+                     Sampler& sampler, TraceStats& stats, Add&& add) const {
+        auto packet = std::clamp(packet_size, 1, max_ray_packet);
+        Ray rays[max_ray_packet];
+        Interval ray_t[max_ray_packet];
+        HitRecord records[max_ray_packet];
+
+        for (int start = 0; start < count; start += packet) {
+            auto n = std::min(packet, count - start);
+            auto start_time = std::chrono::steady_clock::now();
+
+            for (int k = 0; k < n; ++k) {
+                sampler.startSample(i, j, first + start + k);
+                rays[k] = getRay(i, j, sampler);
+                ray_t[k] = Interval(0, infinity);
+            }
+            uint32_t hits = traceCameraRays(world, rays, n, ray_t, records);
+            auto traced_time = std::chrono::steady_clock::now();
+
+            for (int k = 0; k < n; ++k) {
+                sampler.startSample(i, j, first + start + k);
+                add(integrator == Integrator::AmbientOcclusion
+                    ? ambientOcclusion(rays[k], (hits >> k) & 1, records[k], world, sampler, stats)
+                    : rayColor(rays[k], (hits >> k) & 1, records[k], world, materials, sampler, stats));
+            }
+
+            std::chrono::duration<double> primary = traced_time - start_time;
+            std::chrono::duration<double> secondary = std::chrono::steady_clock::now() - traced_time;
+            stats.primary_rays += n;
+            stats.primary_seconds += primary.count();
+            stats.secondary_seconds += secondary.count();
+        }
+    }
+
+    // Traces n camera rays as one packet, returning the mask of rays that hit. The traversal counters only follow
+    // secondary rays, whose order is up to the integrator.
+    static uint32_t traceCameraRays(const Hittable& world, const Ray* rays, int n, Interval* ray_t,
+                                    HitRecord* records) {
+        auto counting = traversal_counters.enabled;
+        traversal_counters.enabled = false;
+        auto hits = n == 1 ? (world.hit(rays[0], ray_t[0], records[0]) ? 1u : 0u)
+                           : world.hitPacket(rays, (1u << n) - 1, ray_t, records);
+        traversal_counters.enabled = counting;
+        return hits;
+    }
+
+    // Path of a wave, identified by its sample
+    struct WavePath {
+        int x, y;
+        int sample;
+        uint32_t range; // Index of the range it belongs to
+    };
+
+    // Breadth-first version of samplePixel() over many ranges. Up to wave_size paths start together and every bounce
+    // goes through the stages in turn for all of them: intersect the queued rays, add the sky to the paths that
+    // missed, sort the hits by material type and shade them, queueing shadow rays towards lights and scattered rays
+    // for the next bounce, then trace the shadow rays. Each stage runs one kind of work over the whole wave, and
+    // every material type is shaded in a single homogeneous run.
+    template<typename Add>
+    void sampleWavefront(const std::vector<SampleRange>& ranges, const Hittable& world,
+                         const MaterialTable& materials, Sampler& sampler, TraceStats& stats, Add&& add) const {
+        auto packet = std::clamp(packet_size, 1, max_ray_packet);
+        auto in_flight = std::clamp(rays_in_flight, 1, max_ray_packet);
+        std::vector<WavePath> paths;
+        std::vector<Color> radiance;
+        PathQueue queue, next_queue;
+        HitQueue hits;
+        ShadowQueue shadows;
+        std::vector<uint32_t> shading_keys, shading_order;
+        std::vector<uint32_t> bin_keys, trace_order;
+
+        size_t range = 0;
+        int taken = 0; // Samples of ranges[range] already in a wave
+        while (range < ranges.size()) {
+            auto start_time = std::chrono::steady_clock::now();
+
+            // Generate: camera rays for the next samples, in range order
+            paths.clear();
+            queue.clear();
+            while (range < ranges.size() && static_cast<int>(paths.size()) < std::max(wave_size, 1)) {
+                const auto& r = ranges[range];
+                auto path_index = static_cast<uint32_t>(paths.size());
+                paths.push_back(WavePath{r.x, r.y, r.first + taken, static_cast<uint32_t>(range)});
+                sampler.startSample(r.x, r.y, r.first + taken);
+                auto ray = getRay(r.x, r.y, sampler);
+                queue.push(path_index, ray, Color(1, 1, 1), 0, ray.origin());
+                if (++taken >= r.count) {
+                    taken = 0;
+                    ++range;
+                }
+            }
+            radiance.assign(paths.size(), Color(0, 0, 0));
+
+            for (int depth = 0; depth < max_depth && queue.size() > 0; ++depth) {
+                // Intersect. Camera rays of a pixel are next to each other in the queue and go in packets.
+                // Scattered rays are binned first if requested, so that neighbours in the trace order read the
+                // same parts of the scene, and go through interleaved in groups of rays_in_flight
+                bool binned = depth > 0 && bin_secondary_rays;
+                if (binned) {
+                    queue.binnedOrder(bin_keys, trace_order);
+                }
+
+                hits.clear();
+                for (size_t o = 0; o < queue.size();) {
+                    auto n = static_cast<int>(std::min<size_t>(depth == 0 ? packet : in_flight, queue.size() - o));
+                    uint32_t entries[max_ray_packet];
+                    Ray rays[max_ray_packet];
+                    Interval ray_t[max_ray_packet];
+                    HitRecord records[max_ray_packet];
+                    for (int k = 0; k < n; ++k) {
+                        entries[k] = binned ? trace_order[o + k] : static_cast<uint32_t>(o + k);
+                        rays[k] = queue.ray(entries[k]);
+                        ray_t[k] = Interval(0, infinity);
+                    }
+
+                    uint32_t hit_mask;
+                    if (depth == 0) {
+                        hit_mask = traceCameraRays(world, rays, n, ray_t, records);
+                    } else if (n > 1) {
+                        hit_mask = world.hitInterleaved(rays, (1u << n) - 1, ray_t, records);
+                    } else {
+                        hit_mask = world.hit(rays[0], ray_t[0], records[0]);
+                    }
+                    for (int k = 0; k < n; ++k) {
+                        if ((hit_mask >> k) & 1) {
+                            hits.push(entries[k], records[k]);
+                        } else {
+                            // Miss: the sky or environment ends the path
+                            radiance[queue.path[entries[k]]] += queue.throughput(entries[k])
+                                                               * background(rays[k], queue.scatterPdf(entries[k]),
+                                                                            environmentProbability());
+                        }
+                    }
+                    o += n;
+                }
+
+                auto traced_time = std::chrono::steady_clock::now();
+                if (depth == 0) {
+                    stats.primary_rays += queue.size();
+                    stats.primary_seconds += std::chrono::duration<double>(traced_time - start_time).count();
+                    start_time = traced_time;
+                } else {
+                    stats.secondary_rays += queue.size();
+                }
+
+                // Shade, in homogeneous runs of one material type
+                shading_keys.resize(hits.size());
+                for (size_t h = 0; h < hits.size(); ++h) {
+                    auto& record = hits.records[h];
+                    record.object->finalizeHit(queue.ray(hits.entry[h]), record);
+                    shading_keys[h] = material_types[record.material];
+                }
+                countingSort(shading_keys, material_type_count, shading_order);
+
+                next_queue.clear();
+                shadows.clear();
+                for (auto h : shading_order) {
+                    auto e = hits.entry[h];
+                    auto p = queue.path[e];
+                    const auto& path = paths[p];
+                    const auto& record = hits.records[h];
+                    auto ray = queue.ray(e);
+                    auto throughput = queue.throughput(e);
+                    radiance[p] += throughput * emitted(record, queue.scatterPdf(e), queue.scatterPoint(e), materials);
+
+                    sampler.startSample(path.x, path.y, path.sample);
+                    Ray shadow;
+                    Real shadow_t_max;
+                    Color light;
+                    if (connectLight(ray, record, depth, materials, sampler, shadow, shadow_t_max, light,
+                                     environmentProbability())) {
+                        shadows.push(p, shadow, shadow_t_max, throughput * light);
+                    }
+
+                    Ray scattered;
+                    Real scatter_pdf;
+                    if (scatterPath(ray, record, depth, materials, sampler, throughput, scattered, scatter_pdf)) {
+                        next_queue.push(p, scattered, throughput, scatter_pdf, record.point);
+                    }
+                }
+                std::swap(queue, next_queue);
+
+                // Connect: the light of every shadow ray that nothing blocks reaches its path
+                for (size_t s = 0; s < shadows.size(); ++s) {
+                    if (!world.occluded(shadows.rays[s], Interval(0, shadows.t_max[s]))) {
+                        radiance[shadows.path[s]] += shadows.contribution[s];
+                    }
+                }
+                stats.secondary_rays += shadows.size();
+            }
+
+            std::chrono::duration<double> secondary = std::chrono::steady_clock::now() - start_time;
+            stats.secondary_seconds += secondary.count();
+
+            for (size_t p = 0; p < paths.size(); ++p) {
+                add(paths[p].range, radiance[p]);
+            }
+        }
+    }
+
+    // Sampler dimensions used by a path: the camera takes the first ones, then every bounce gets a fixed range that
+    // starts with the material's scatter() and light sampling, and whose last dimension decides Russian roulette
+    static constexpr uint32_t camera_dimensions = 4;
+    static constexpr uint32_t scatter_dimensions = 3;
+    static constexpr uint32_t light_dimensions = 3;
+    static constexpr uint32_t bounce_dimensions = scatter_dimensions + light_dimensions + 1;
+    // Light resampling uses dimensions far above any path's: each candidate takes a light, a point on it and the
+    // reservoir's choice, then reuse takes the neighbour offsets and the choices among the reservoirs
+    static constexpr uint32_t resampling_dimension = 1u << 16;
+    static constexpr uint32_t candidate_dimensions = 4;
+    static constexpr int max_resampling_neighbors = 16;
+
+    Ray getRay(int i, int j, Sampler& sampler) const {
         // Get a randomly sampled camera ray for the pixel at i,j originating from the camera defocus disk
 
         auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-        auto pixel_sample = pixel_center + pixelSampleSquare();
+        sampler.setDimension(0);
+        auto pixel_sample = pixel_center + pixelSampleSquare(sampler);
 
-        auto ray_origin = (defocus_angle <= 0) ? center : defocusDiskSample();
+        sampler.setDimension(2);
+        auto ray_origin = (defocus_angle <= 0) ? center : defocusDiskSample(sampler);
         auto ray_direction = pixel_sample - ray_origin;
 
         return Ray(ray_origin, ray_direction);
     }
 
     // Returns a random point in the square surrounding the pixel center
-    Vec3 pixelSampleSquare() const {
-        auto px = -0.5 + randomDouble();
-        auto py = -0.5 + randomDouble();
+    Vec3 pixelSampleSquare(Sampler& sampler) const {
+        auto sample = sampler.get2D();
+        auto px = -0.5 + sample.u;
+        auto py = -0.5 + sample.v;
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 
-    static Color rayColor(const Ray& ray, int depth, const Hittable& world) {
-        HitRecord record;
+    // Follows a path from its camera ray, already traced into `hit` and `record`, until it escapes, is absorbed,
+    // reaches max_depth or is ended by Russian roulette, carrying the product of the attenuations along the way as
+    // its throughput and adding up the light it meets. A primary_light estimated by resampling replaces next event
+    // estimation at the first hit, and then the emission the first scattered ray finds is left to it.
+    Color rayColor(Ray ray, bool hit, HitRecord record, const Hittable& world, const MaterialTable& materials,
+                   Sampler& sampler, TraceStats& stats, const Color* primary_light = nullptr) const {
+        Color radiance(0, 0, 0);
+        Color throughput(1, 1, 1);
+        Real scatter_pdf = 0;
+        Point3 scatter_point; // Hit the ray was scattered from, where light sampling took its reference point
+        Real environment_probability = 0; // With which the previous hit's connection sampled the environment
 
-        if (depth <= 0) {
-            return Color(0, 0, 0);
-        }
+        for (int depth = 0; depth < max_depth; ++depth) {
+            if (depth > 0) {
+                ++stats.secondary_rays;
+                // Scattered rays start off the surface they leave (see HitRecord::spawnRay), so no hit needs to be
+                // skipped
+                hit = world.hit(ray, Interval(0, infinity), record);
+            }
+
+            if (!hit) {
+                return radiance + throughput * background(ray, scatter_pdf, environment_probability);
+            }
+
+            record.object->finalizeHit(ray, record);
+            if (!(depth == 1 && primary_light && scatter_pdf > 0)) {
+                radiance += throughput * emitted(record, scatter_pdf, scatter_point, materials);
+            }
+
+            // Resampling only covers the scene's lights, so the environment is connected on its own there
+            bool resampled = depth == 0 && primary_light;
+            if (resampled) {
+                radiance += *primary_light;
+            }
+            environment_probability = resampled && environment ? 1 : environmentProbability();
+
+            Ray shadow;
+            Real shadow_t_max;
+            Color light;
+            if ((!resampled || environment)
+                && connectLight(ray, record, depth, materials, sampler, shadow, shadow_t_max, light,
+                                environment_probability)) {
+                ++stats.secondary_rays;
+                if (!world.occluded(shadow, Interval(0, shadow_t_max))) {
+                    radiance += throughput * light;
+                }
+            }
 
-        if (world.hit(ray, Interval(0.001, infinity), record)) {
             Ray scattered;
-            Color attenuation;
-            if (record.material->scatter(ray, record, attenuation, scattered)) {
-                return attenuation * rayColor(scattered, depth-1, world);
+            if (!scatterPath(ray, record, depth, materials, sampler, throughput, scattered, scatter_pdf)) {
+                return radiance;
             }
+            scatter_point = record.point;
+            ray = scattered;
+        }
+
+        return radiance;
+    }
+
+    // Visibility of the surface a camera ray hit along one cosine-weighted direction: white when nothing lies within
+    // ao_distance that way, black otherwise. Averaged over samples this is the unoccluded fraction of the
+    // hemisphere. Rays that miss are white.
+    Color ambientOcclusion(const Ray& ray, bool hit, HitRecord record, const Hittable& world, Sampler& sampler,
+                           TraceStats& stats) const {
+        if (!hit) {
+            return Color(1, 1, 1);
+        }
+
+        record.object->finalizeHit(ray, record);
+        sampler.setDimension(camera_dimensions);
+        auto u = sampler.get2D();
+        auto occlusion_ray = record.spawnRay(sampleCosineHemisphere(record.normal, u.u, u.v));
+        ++stats.secondary_rays;
+        return world.occluded(occlusion_ray, Interval(0, ao_distance)) ? Color(0, 0, 0) : Color(1, 1, 1);
+    }
+
+    // Scatters a path at the finalized hit of its ray at the given depth, with the sampler at the path's sample.
+    // Multiplies throughput by the attenuation and decides Russian roulette, returning false when the path ends.
+    // scatter_pdf receives the density of the scattered direction for emitted().
+    bool scatterPath(const Ray& ray, const HitRecord& record, int depth, const MaterialTable& materials,
+                     Sampler& sampler, Color& throughput, Ray& scattered, Real& scatter_pdf) const {
+        Color attenuation;
+        const auto& material = materials[record.material];
+        auto dimension = camera_dimensions + bounce_dimensions * depth;
+        sampler.setDimension(dimension);
+        if (!material.scatter(ray, record, attenuation, scattered, sampler)) {
+            return false;
+        }
+        throughput = throughput * attenuation;
+        scatter_pdf = sample_lights ? material.scatterPdf(ray, record, unitVector(scattered.direction())) : 0;
+
+        // Past the minimum depth a path survives with a probability that follows its throughput, and the survivors
+        // are weighted up by the same factor, so the expected result is unchanged
+        if (depth + 1 >= roulette_min_depth) {
+            auto survival = std::min<Real>(1, std::max({throughput.x(), throughput.y(), throughput.z()}));
+            sampler.setDimension(dimension + bounce_dimensions - 1);
+            if (sampler.get1D() >= survival) {
+                return false;
+            }
+            throughput = throughput / survival;
+        }
+        return true;
+    }
+
+    // Light that the surface of a finalized hit emits back along the ray. When the ray was scattered with density
+    // scatter_pdf > 0 from the hit at scatter_point, light sampling there could have picked the same point, and the
+    // emission is weighed against that by the power heuristic, with the densities taken at that hit as
+    // connectLight() did rather than at the ray's offset origin. Camera rays and rays scattered into isolated
+    // directions pass 0.
+    Color emitted(const HitRecord& record, Real scatter_pdf, const Point3& scatter_point,
+                  const MaterialTable& materials) const {
+        auto emission = materials[record.material].emission();
+        if (!record.front_face || emission.nearZero()) {
             return Color(0, 0, 0);
         }
+        if (!(scatter_pdf > 0)) {
+            return emission;
+        }
+
+        auto light = lights.find(record.object, record.primitive);
+        if (light < 0) {
+            return emission;
+        }
+        auto light_pdf = (1 - environmentProbability()) * lights.probability(light, scatter_point)
+                         * lights[light].pdf(scatter_point, record.point);
+        return emission * powerHeuristic(scatter_pdf, light_pdf);
+    }
+
+    // Probability with which connectLight() samples the environment rather than one of the scene's lights
+    [[nodiscard]] Real environmentProbability() const {
+        if (!environment) {
+            return 0;
+        }
+        return lights.empty() ? 1 : Real(0.5);
+    }
+
+    // Next event estimation at a finalized hit: picks the environment with the given probability, or else a light
+    // and a point on it, with this bounce's light dimensions, and returns the shadow ray to the point, the t up to
+    // which it must be unblocked, and the light that then reaches the path per unit throughput, weighed against
+    // scatter() picking the same direction by the power heuristic. Returns false when there is nothing to connect.
+    bool connectLight(const Ray& ray, const HitRecord& record, int depth, const MaterialTable& materials,
+                      Sampler& sampler, Ray& shadow, Real& shadow_t_max, Color& light,
+                      Real environment_probability) const {
+        if (!sample_lights || (lights.empty() && !(environment_probability > 0))) {
+            return false;
+        }
+
+        sampler.setDimension(camera_dimensions + bounce_dimensions * depth + scatter_dimensions);
+        Real pick = sampler.get1D();
+        bool from_environment = pick < environment_probability;
+        Real pick_probability;
+        const Light* picked = nullptr;
+        if (from_environment) {
+            pick_probability = environment_probability;
+        } else {
+            // The part of the number past the environment's share picks among the lights
+            if (environment_probability > 0) {
+                pick = std::min((pick - environment_probability) / (1 - environment_probability),
+                                Real(1) - std::numeric_limits<Real>::epsilon());
+            }
+            picked = &lights[lights.pick(record.point, pick, pick_probability)];
+            pick_probability *= 1 - environment_probability;
+        }
+        auto point = sampler.get2D();
+        LightSample sample;
+        if (from_environment) {
+            if (!environment->sample(point.u, point.v, sample.direction, sample.radiance, sample.pdf)) {
+                return false;
+            }
+            sample.radiance = sky_brightness * sample.radiance;
+            sample.distance = infinity;
+            sample.normal = -sample.direction;
+        } else if (!picked->sample(record.point, point.u, point.v, sample)) {
+            return false;
+        }
+
+        const auto& material = materials[record.material];
+        auto bsdf = material.evaluate(ray, record, sample.direction);
+        if (bsdf.nearZero()) {
+            return false;
+        }
+
+        auto light_pdf = pick_probability * sample.pdf;
+        auto weight = powerHeuristic(light_pdf, material.scatterPdf(ray, record, sample.direction));
+        light = bsdf * sample.radiance * (weight / light_pdf);
+
+        if (from_environment) {
+            shadow = record.spawnRay(sample.direction);
+            shadow_t_max = infinity;
+            return true;
+        }
+
+        // The ray is aimed from its offset origin at the point itself, so the point is at t = 1 whatever the offset
+        auto target = record.point + sample.distance * sample.direction;
+        auto origin = record.spawnRay(sample.direction).origin();
+        shadow = Ray(origin, target - origin);
+        shadow_t_max = 1 - shadow_ray_margin;
+        return true;
+    }
+
+    // Light reaching a ray that leaves the scene, from the environment map if there is one. A ray scattered with
+    // density scatter_pdf > 0 could also have been found by the previous connection, which sampled the environment
+    // with the given probability, and is weighed against that by the power heuristic.
+    Color background(const Ray& ray, Real scatter_pdf, Real environment_probability) const {
+        if (!environment) {
+            return skyColor(ray);
+        }
+        auto radiance = sky_brightness * environment->radiance(ray.direction());
+        if (!(scatter_pdf > 0)) {
+            return radiance;
+        }
+        return radiance * powerHeuristic(scatter_pdf, environment_probability * environment->pdf(ray.direction()));
+    }
 
+    Color skyColor(const Ray& ray) const {
         Vec3 unit_direction = unitVector(ray.direction());
         auto a = 0.7*(unit_direction.y() + 1.0);
-        return (1.0-a)*Color(1.0, 1.0, 1.0) + a*Color(0.5, 0.7, 1.0);
+        return sky_brightness * ((1.0-a)*Color(1.0, 1.0, 1.0) + a*Color(0.5, 0.7, 1.0));
     }
 
-    Point3 defocusDiskSample() const {
+    Point3 defocusDiskSample(Sampler& sampler) const {
         // Get a random point on the camera defocus disk
-        auto p = randomInUnitDisk();
+        auto sample = sampler.get2D();
+        auto p = sampleUnitDisk(sample.u, sample.v);
         return center + (p.x() * defocus_disk_u) + (p.y() * defocus_disk_v);
     }
 };
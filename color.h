@@ -7,11 +7,19 @@
 
 using Color = Vec3;
 
+// Sum of the samples of a pixel, kept in double precision in every build so long sums and their variance stay exact
+using ColorSum = Vec3T<double>;
+
+// Mean of the three channels, the scalar brightness by which lights and light samples are compared
+inline Real averageChannel(const Color& c) {
+    return (c.x() + c.y() + c.z()) / 3;
+}
+
 inline double linear_to_gamma(double linear_component) {
     return sqrt(linear_component);
 }
 
-void writeColor(std::vector<unsigned char>& pixels, int index, Color pixel_color, int spp) {
+void writeColor(std::vector<unsigned char>& pixels, int index, ColorSum pixel_color, int spp) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -27,7 +35,7 @@ void writeColor(std::vector<unsigned char>& pixels, int index, Color pixel_color
     b = linear_to_gamma(b);
 
     // Write the translated [0,255] value of each color component
-    static const Interval intensity(0.0, 0.999);
+    static const IntervalT<double> intensity(0.0, 0.999);
     pixels[index] = static_cast<unsigned char>(256 * intensity.clamp(r));
     pixels[index+1] = static_cast<unsigned char>(256 * intensity.clamp(g));
     pixels[index+2] = static_cast<unsigned char>(256 * intensity.clamp(b));
@@ -0,0 +1,174 @@
+#ifndef RAYTRACER_DISTRIBUTION_H
+#define RAYTRACER_DISTRIBUTION_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "mathutils.h"
+
+// Picks index i with probability weights[i] / sum(weights) from one uniform number in constant time (Walker's alias
+// method, built with Vose's algorithm). Every bin holds the probability of its own index and the index that fills
+// the rest of it. Weights that are all zero give a uniform choice.
+class AliasTable {
+public:
+    AliasTable() = default;
+
+    explicit AliasTable(const std::vector<Real>& weights) {
+        auto n = weights.size();
+        bins.resize(n);
+        probabilities.resize(n);
+        if (n == 0) {
+            return;
+        }
+
+        double total = 0;
+        for (auto w : weights) {
+            total += w;
+        }
+
+        // Bins are scaled so that the average is 1, then underfull ones are topped up from overfull ones
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; ++i) {
+            probabilities[i] = total > 0 ? static_cast<Real>(weights[i] / total) : Real(1) / n;
+            scaled[i] = total > 0 ? weights[i] / total * n : 1;
+            (scaled[i] < 1 ? small : large).push_back(static_cast<uint32_t>(i));
+        }
+        while (!small.empty() && !large.empty()) {
+            auto s = small.back();
+            small.pop_back();
+            auto l = large.back();
+            bins[s] = Bin{static_cast<Real>(scaled[s]), l};
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // What remains is full up to rounding
+        for (auto i : small) {
+            bins[i] = Bin{1, i};
+        }
+        for (auto i : large) {
+            bins[i] = Bin{1, i};
+        }
+    }
+
+    [[nodiscard]] size_t size() const { return bins.size(); }
+
+    [[nodiscard]] bool empty() const { return bins.empty(); }
+
+    // Index picked by the uniform number u in [0, 1): its integer part in units of bins selects a bin and the
+    // fraction decides between the bin's own index and its alias
+    [[nodiscard]] size_t sample(Real u) const {
+        auto scaled = u * bins.size();
+        auto bin = std::min(static_cast<size_t>(scaled), bins.size() - 1);
+        const auto& b = bins[bin];
+        return scaled - bin < b.threshold ? bin : b.alias;
+    }
+
+    // Probability with which sample() returns i
+    [[nodiscard]] Real probability(size_t i) const { return probabilities[i]; }
+
+private:
+    struct Bin {
+        Real threshold; // Fraction of the bin that belongs to its own index
+        uint32_t alias; // Index that the rest of the bin belongs to
+    };
+
+    std::vector<Bin> bins;
+    std::vector<Real> probabilities;
+};
+
+// Piecewise-constant density over [0, 1) with one step per weight, sampled by inverting its cumulative distribution.
+// Unlike the alias method this is monotonic in u, so stratified numbers give stratified samples. Weights that are
+// all zero give a uniform density.
+class PiecewiseConstant1D {
+public:
+    PiecewiseConstant1D() = default;
+
+    explicit PiecewiseConstant1D(const std::vector<Real>& weights) : function(weights), cdf(weights.size() + 1) {
+        auto n = weights.size();
+        std::vector<double> running(n + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            running[i + 1] = running[i] + std::max<double>(weights[i], 0) / n;
+        }
+        total = running[n];
+        for (size_t i = 0; i <= n; ++i) {
+            cdf[i] = static_cast<Real>(total > 0 ? running[i] / total : static_cast<double>(i) / n);
+        }
+        if (!(total > 0)) {
+            std::fill(function.begin(), function.end(), Real(1));
+        }
+    }
+
+    [[nodiscard]] size_t size() const { return function.size(); }
+
+    // Integral of the weights over [0, 1), each spanning 1 / size()
+    [[nodiscard]] double integral() const { return total; }
+
+    // Point in [0, 1) for the uniform number u, with the density there and the step it falls in
+    [[nodiscard]] Real sample(Real u, Real& density, size_t& step) const {
+        auto it = std::upper_bound(cdf.begin(), cdf.end(), u);
+        step = std::min(static_cast<size_t>(std::max<ptrdiff_t>(it - cdf.begin() - 1, 0)), size() - 1);
+        auto width = cdf[step + 1] - cdf[step];
+        auto offset = width > 0 ? (u - cdf[step]) / width : Real(0);
+        density = this->density(step);
+        return std::min((step + offset) / size(), Real(1) - std::numeric_limits<Real>::epsilon());
+    }
+
+    // Density of the points of the given step
+    [[nodiscard]] Real density(size_t step) const {
+        return total > 0 ? static_cast<Real>(function[step] / total) : Real(1);
+    }
+
+private:
+    std::vector<Real> function;
+    std::vector<Real> cdf;
+    double total = 0;
+};
+
+// Piecewise-constant density over [0, 1)^2 with one cell per weight, width cells to a row, sampled by picking a row
+// from the marginal density of the rows and then a point within it from the row's own density
+class PiecewiseConstant2D {
+public:
+    PiecewiseConstant2D() = default;
+
+    PiecewiseConstant2D(const std::vector<Real>& weights, size_t width, size_t height) : rows(height) {
+        std::vector<Real> marginal(height);
+        for (size_t y = 0; y < height; ++y) {
+            rows[y] = PiecewiseConstant1D(std::vector<Real>(weights.begin() + y*width,
+                                                            weights.begin() + (y + 1)*width));
+            marginal[y] = static_cast<Real>(rows[y].integral());
+        }
+        row_density = PiecewiseConstant1D(marginal);
+    }
+
+    [[nodiscard]] bool empty() const { return rows.empty(); }
+
+    // Point (u, v) for two uniform numbers, v picking the row and u the point along it, and its density
+    void sample(Real u1, Real u2, Real& u, Real& v, Real& density) const {
+        Real v_density, u_density;
+        size_t row, column;
+        v = row_density.sample(u2, v_density, row);
+        u = rows[row].sample(u1, u_density, column);
+        density = v_density * u_density;
+    }
+
+    // Density of the point (u, v)
+    [[nodiscard]] Real density(Real u, Real v) const {
+        auto row = std::min(static_cast<size_t>(std::max(v, Real(0)) * rows.size()), rows.size() - 1);
+        const auto& r = rows[row];
+        auto column = std::min(static_cast<size_t>(std::max(u, Real(0)) * r.size()), r.size() - 1);
+        return row_density.density(row) * r.density(column);
+    }
+
+private:
+    std::vector<PiecewiseConstant1D> rows;
+    PiecewiseConstant1D row_density; // Marginal density of the rows
+};
+
+#endif //RAYTRACER_DISTRIBUTION_H
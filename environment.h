@@ -0,0 +1,202 @@
+#ifndef RAYTRACER_ENVIRONMENT_H
+#define RAYTRACER_ENVIRONMENT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "color.h"
+#include "distribution.h"
+
+// Light arriving from infinitely far away, given by a high dynamic range image in the latitude-longitude layout: the
+// top row looks straight up (+y), the bottom row straight down, and the columns go once around the y axis starting
+// from +x towards +z. Directions are importance sampled with a piecewise-constant density over the image that follows
+// the brightness of each texel times the solid angle it covers, so a small, bright sun is found by a fraction of the
+// samples that need to hit it by chance.
+class EnvironmentMap {
+public:
+    EnvironmentMap(int _width, int _height, std::vector<Color> _texels)
+        : width(_width), height(_height), texels(std::move(_texels)) {
+        std::vector<Real> weights(texels.size());
+        for (int y = 0; y < height; ++y) {
+            // Rows near the poles cover less solid angle, by the sine of their polar angle
+            auto sin_theta = static_cast<Real>(std::sin(pi * (y + 0.5) / height));
+            for (int x = 0; x < width; ++x) {
+                weights[y*width + x] = std::max(averageChannel(texels[y*width + x]), Real(0)) * sin_theta;
+            }
+        }
+        distribution = PiecewiseConstant2D(weights, width, height);
+    }
+
+    // Radiance arriving along the reverse of `direction`, that is seen when looking along it
+    [[nodiscard]] Color radiance(const Vec3& direction) const {
+        Real u, v;
+        toImage(direction, u, v);
+        return texels[texel(u, v)];
+    }
+
+    // Picks a direction towards the environment from two uniform numbers, with its radiance and density per unit
+    // solid angle. Returns false for the degenerate samples at the poles.
+    bool sample(Real u1, Real u2, Vec3& direction, Color& radiance, Real& pdf) const {
+        Real u, v, density;
+        distribution.sample(u1, u2, u, v, density);
+        auto theta = Real(pi) * v;
+        auto phi = Real(2*pi) * u;
+        auto sin_theta = std::sin(theta);
+        if (!(density > 0 && sin_theta > 0)) {
+            return false;
+        }
+        direction = Vec3(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+        radiance = texels[texel(u, v)];
+        pdf = density / (Real(2*pi*pi) * sin_theta);
+        return true;
+    }
+
+    // Density per unit solid angle with which sample() picks `direction`
+    [[nodiscard]] Real pdf(const Vec3& direction) const {
+        Real u, v;
+        toImage(direction, u, v);
+        auto sin_theta = std::sin(Real(pi) * v);
+        return sin_theta > 0 ? distribution.density(u, v) / (Real(2*pi*pi) * sin_theta) : 0;
+    }
+
+private:
+    int width, height;
+    std::vector<Color> texels; // Rows from the top
+    PiecewiseConstant2D distribution;
+
+    // Image coordinates in [0, 1)^2 of a direction, which need not be a unit vector
+    static void toImage(const Vec3& direction, Real& u, Real& v) {
+        auto d = unitVector(direction);
+        auto phi = std::atan2(d.z(), d.x());
+        u = phi < 0 ? phi / Real(2*pi) + 1 : phi / Real(2*pi);
+        v = std::acos(std::clamp(d.y(), Real(-1), Real(1))) / Real(pi);
+    }
+
+    [[nodiscard]] size_t texel(Real u, Real v) const {
+        auto x = std::min(static_cast<int>(u * width), width - 1);
+        auto y = std::min(static_cast<int>(v * height), height - 1);
+        return static_cast<size_t>(y) * width + x;
+    }
+};
+
+// Reads a high dynamic range image, either a Portable Float Map (.pfm, color or grayscale) or a Radiance RGBE file
+// (.hdr, flat or run-length encoded scanlines in the usual -Y +X orientation), into rows of linear colors from the
+// top. Returns false with a message in `error` if the file cannot be read.
+inline bool readHdrImage(const std::string& path, int& width, int& height, std::vector<Color>& texels,
+                         std::string& error) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::string magic;
+    std::getline(file, magic);
+    if (magic == "PF" || magic == "Pf") {
+        int channels = magic == "PF" ? 3 : 1;
+        double scale;
+        if (!(file >> width >> height >> scale) || width <= 0 || height <= 0) {
+            error = path + ": malformed PFM header";
+            return false;
+        }
+        file.get(); // The single whitespace character before the data
+
+        // Rows go from the bottom, in the byte order the sign of the scale gives
+        std::vector<float> data(static_cast<size_t>(width) * height * channels);
+        if (!file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size() * 4))) {
+            error = path + ": truncated PFM data";
+            return false;
+        }
+        uint16_t probe = 1;
+        bool little_endian_host = *reinterpret_cast<unsigned char*>(&probe) == 1;
+        if ((scale < 0) != little_endian_host) {
+            for (auto& f : data) {
+                unsigned char bytes[4];
+                std::memcpy(bytes, &f, 4);
+                std::swap(bytes[0], bytes[3]);
+                std::swap(bytes[1], bytes[2]);
+                std::memcpy(&f, bytes, 4);
+            }
+        }
+
+        texels.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const auto* p = &data[(static_cast<size_t>(height - 1 - y) * width + x) * channels];
+                texels[static_cast<size_t>(y) * width + x] = channels == 3 ? Color(p[0], p[1], p[2])
+                                                                           : Color(p[0], p[0], p[0]);
+            }
+        }
+        return true;
+    }
+
+    if (magic != "#?RADIANCE" && magic != "#?RGBE") {
+        error = path + ": not a PFM or Radiance HDR image";
+        return false;
+    }
+    // Header variables up to an empty line, then the resolution
+    std::string line;
+    while (std::getline(file, line) && !line.empty()) {
+        if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+            error = path + ": unsupported " + line;
+            return false;
+        }
+    }
+    char y_axis[3], x_axis[3];
+    if (!std::getline(file, line) || std::sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &height, x_axis, &width) != 4
+        || std::string(y_axis) != "-Y" || std::string(x_axis) != "+X" || width <= 0 || height <= 0) {
+        error = path + ": unsupported resolution line " + line;
+        return false;
+    }
+
+    texels.resize(static_cast<size_t>(width) * height);
+    std::vector<unsigned char> scanline(static_cast<size_t>(width) * 4);
+    for (int y = 0; y < height; ++y) {
+        unsigned char start[4];
+        if (!file.read(reinterpret_cast<char*>(start), 4)) {
+            error = path + ": truncated HDR data";
+            return false;
+        }
+        if (width >= 8 && width < 0x8000 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width) {
+            // Run-length encoded, one channel after the other, each as runs and literal stretches
+            for (int c = 0; c < 4; ++c) {
+                for (int x = 0; x < width;) {
+                    int count = file.get();
+                    bool run = count > 128;
+                    count = run ? count - 128 : count;
+                    if (count <= 0 || x + count > width) {
+                        error = path + ": corrupt HDR scanline";
+                        return false;
+                    }
+                    for (int k = 0; k < count; ++k, ++x) {
+                        scanline[x*4 + c] = static_cast<unsigned char>(run && k > 0 ? scanline[(x - 1)*4 + c]
+                                                                                     : file.get());
+                    }
+                }
+            }
+        } else {
+            std::memcpy(scanline.data(), start, 4);
+            file.read(reinterpret_cast<char*>(scanline.data() + 4), static_cast<std::streamsize>(scanline.size() - 4));
+        }
+        if (!file) {
+            error = path + ": truncated HDR data";
+            return false;
+        }
+
+        for (int x = 0; x < width; ++x) {
+            const auto* rgbe = &scanline[x*4];
+            auto scale = rgbe[3] ? std::ldexp(1.0, rgbe[3] - (128 + 8)) : 0.0;
+            texels[static_cast<size_t>(y) * width + x] = Color(rgbe[0] * scale, rgbe[1] * scale, rgbe[2] * scale);
+        }
+    }
+    return true;
+}
+
+#endif //RAYTRACER_ENVIRONMENT_H
@@ -1,18 +1,35 @@
 #ifndef RAYTRACER_HITTABLE_H
 #define RAYTRACER_HITTABLE_H
 
+#include <cstdint>
+
 #include "vec3.h"
 #include "ray.h"
 #include "interval.h"
+#include "aabb.h"
+
+// Index of a material in the scene's MaterialTable
+using MaterialId = uint32_t;
 
-class Material;
+// Most rays Hittable::hitPacket traces together, one bit each in its masks
+constexpr int max_ray_packet = 16;
 
+class Hittable;
+class LightList;
+class MaterialTable;
+
+// Intersection only fills in t, object and primitive. The remaining shading data is computed once, for the
+// closest hit, by object->finalizeHit().
 class HitRecord {
 public:
+    Real t;
+    const Hittable* object; // Primitive that was hit
+    uint32_t primitive; // Index of the hit element within object, for primitives that hold several
+
     Point3 point;
+    Real point_error; // Bound on the distance of point from the true surface
     Vec3 normal;
-    shared_ptr<Material> material;
-    double t;
+    MaterialId material;
     bool front_face;
 
     // Sets the hit record normal vector
@@ -21,13 +38,61 @@ public:
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Ray from the hit point in the given direction, starting off the surface on the side it leaves to, so it can
+    // be traced from t = 0 without hitting the surface again
+    [[nodiscard]] Ray spawnRay(const Vec3& direction) const {
+        auto side = dot(direction, normal) < 0 ? -normal : normal;
+        return Ray(offsetRayOrigin(point, side, point_error), direction);
+    }
 };
 
 class Hittable {
 public:
     virtual ~Hittable() = default;
 
+    // Finds the closest intersection inside ray_t. rec is only written on a hit, and only t, object and primitive.
     virtual bool hit(const Ray &r, Interval ray_t, HitRecord& rec) const = 0;
+
+    // Closest intersections of the rays whose bits are set in `active`, traced together so that hierarchies can share
+    // node tests between coherent rays such as camera rays. For each ray that hits, recs[i] is written as by hit()
+    // and ray_t[i].max is lowered to the hit. Returns the mask of rays that hit. By default the rays are traced
+    // one at a time.
+    virtual uint32_t hitPacket(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const {
+        uint32_t hits = 0;
+        while (active) {
+            int i = __builtin_ctz(active);
+            active &= active - 1;
+            if (hit(rays[i], ray_t[i], recs[i])) {
+                ray_t[i].max = recs[i].t;
+                hits |= 1u << i;
+            }
+        }
+        return hits;
+    }
+
+    // Whether anything blocks the ray inside ray_t, for shadow and visibility rays. Stops at the first intersection
+    // found rather than the closest, and records nothing. By default hit() is used.
+    virtual bool occluded(const Ray& r, Interval ray_t) const {
+        HitRecord rec;
+        return hit(r, ray_t, rec);
+    }
+
+    // Same as hitPacket() for rays that need not be coherent, such as scattered rays. Hierarchies keep the rays in
+    // flight together and switch between them while node fetches are pending, so that their cache misses overlap.
+    // By default the rays are traced one at a time.
+    virtual uint32_t hitInterleaved(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const {
+        return Hittable::hitPacket(rays, active, ray_t, recs);
+    }
+
+    // Fills in the point, normal, face orientation and material of a hit that this primitive recorded. Aggregates
+    // never record themselves as the hit object and keep this empty.
+    virtual void finalizeHit(const Ray& r, HitRecord& rec) const {}
+
+    // Adds a light to `lights` for every primitive with an emissive material. Aggregates collect their objects' lights.
+    virtual void collectLights(const MaterialTable& materials, LightList& lights) const {}
+
+    virtual AABB boundingBox() const = 0;
 };
 
 #endif //RAYTRACER_HITTABLE_H
@@ -14,27 +14,65 @@ public:
     HittableList() {}
     HittableList(shared_ptr<Hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        bbox = AABB();
+    }
 
     void add(shared_ptr<Hittable> object) {
         objects.push_back(object);
+        bbox = AABB(bbox, object->boundingBox());
     }
 
     bool hit(const Ray &ray, Interval ray_t, HitRecord& rec) const override {
-        HitRecord temp_record;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
 
         for (const auto& object : objects) {
-            if (object->hit(ray, Interval(ray_t.min, closest_so_far), temp_record)) {
+            if (object->hit(ray, Interval(ray_t.min, closest_so_far), rec)) {
                 hit_anything = true;
-                closest_so_far = temp_record.t;
-                rec = temp_record;
+                closest_so_far = rec.t;
             }
         }
 
         return hit_anything;
     }
+
+    bool occluded(const Ray& ray, Interval ray_t) const override {
+        for (const auto& object : objects) {
+            if (object->occluded(ray, ray_t)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t hitPacket(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const override {
+        uint32_t hits = 0;
+        for (const auto& object : objects) {
+            hits |= object->hitPacket(rays, active, ray_t, recs);
+        }
+        return hits;
+    }
+
+    uint32_t hitInterleaved(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const override {
+        uint32_t hits = 0;
+        for (const auto& object : objects) {
+            hits |= object->hitInterleaved(rays, active, ray_t, recs);
+        }
+        return hits;
+    }
+
+    void collectLights(const MaterialTable& materials, LightList& lights) const override {
+        for (const auto& object : objects) {
+            object->collectLights(materials, lights);
+        }
+    }
+
+    AABB boundingBox() const override { return bbox; }
+
+private:
+    AABB bbox;
 };
 
 #endif //RAYTRACER_HITTABLE_LIST_H
@@ -4,29 +4,39 @@
 #include <functional>
 #include "mathutils.h"
 
-class Interval {
+template<typename T>
+class IntervalT {
 public:
-    double min, max;
+    T min, max;
 
-    Interval(double _min, double _max) : min(_min), max(_max) {}
+    IntervalT(T _min, T _max) : min(_min), max(_max) {}
 
-    Interval() : min(+infinity), max(-infinity) {}
+    IntervalT() : min(+infinity), max(-infinity) {}
 
-    [[nodiscard]] bool contains(double x) const {
+    // Smallest interval enclosing both a and b
+    IntervalT(const IntervalT& a, const IntervalT& b) : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
+
+    [[nodiscard]] T size() const {
+        return max - min;
+    }
+
+    [[nodiscard]] bool contains(T x) const {
         return min <= x && x <= max;
     }
 
-    [[nodiscard]] bool surrounds(double x) const {
+    [[nodiscard]] bool surrounds(T x) const {
         return min < x && x < max;
     }
 
-    double clamp(double x) const {
+    T clamp(T x) const {
         return std::clamp(x, min, max);
     }
 
-    static const Interval empty, universe;
+    static const IntervalT empty, universe;
 };
 
+using Interval = IntervalT<Real>;
+
 const static Interval empty (+infinity, -infinity);
 const static Interval universe (-infinity, +infinity);
 
@@ -0,0 +1,252 @@
+#ifndef RAYTRACER_LIGHT_H
+#define RAYTRACER_LIGHT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "color.h"
+#include "distribution.h"
+#include "hittable.h"
+#include "light_bvh.h"
+
+// Shadow rays stop this fraction of their length short of the light, so they never hit the light itself
+constexpr Real shadow_ray_margin = Real(1e-4);
+
+// Point on a light picked for next event estimation, as seen from the shading point
+struct LightSample {
+    Vec3 direction; // Unit vector from the shading point towards the light
+    Real distance;
+    Real pdf; // Density per unit solid angle at the shading point
+    Color radiance; // Emitted towards the shading point
+    Vec3 normal; // Unit normal of the light's surface at the point, on the side it emits from
+};
+
+// Power heuristic with exponent 2 (Veach), the weight of a sample taken with density f that another technique could
+// also have produced with density g
+inline Real powerHeuristic(Real f, Real g) {
+    return f*f / (f*f + g*g);
+}
+
+// Emitting surface that can be sampled directly. Emission leaves the front face of the surface only, like
+// DiffuseLight.
+class Light {
+public:
+    virtual ~Light() = default;
+
+    // Picks a point on the light from two uniform numbers, returning false when the light cannot reach reference
+    virtual bool sample(const Point3& reference, Real u1, Real u2, LightSample& sample) const = 0;
+
+    // Density per unit solid angle with which sample() picks `point` on the light, seen from reference
+    virtual Real pdf(const Point3& reference, const Point3& point) const = 0;
+
+    // Total emitted power, averaged over the color channels, which lights are picked in proportion to
+    [[nodiscard]] virtual Real power() const = 0;
+
+    [[nodiscard]] virtual AABB bounds() const = 0;
+};
+
+// Sphere emitting outwards, sampled uniformly within the cone it subtends, which only wastes samples on points that
+// face away when the sphere is seen from close by
+class SphereLight : public Light {
+public:
+    SphereLight(const Point3& _center, Real _radius, const Color& _radiance)
+        : center(_center), radius(_radius), radiance(_radiance) {}
+
+    bool sample(const Point3& reference, Real u1, Real u2, LightSample& sample) const override {
+        Vec3 to_center = center - reference;
+        auto distance_squared = to_center.lengthSquared();
+        Real one_minus_cos_max;
+        if (!cone(distance_squared, one_minus_cos_max)) {
+            return false;
+        }
+
+        sample.direction = sampleCone(to_center / sqrt(distance_squared), one_minus_cos_max, u1, u2);
+
+        // Nearer intersection with the sphere, with the discriminant in the precise form Sphere::hit uses
+        auto half_b = dot(sample.direction, to_center);
+        auto discriminant = radius*radius - cross(sample.direction, to_center).lengthSquared();
+        sample.distance = half_b - sqrt(fmax(Real(0), discriminant));
+        sample.pdf = 1 / (2 * Real(pi) * one_minus_cos_max);
+        sample.radiance = radiance;
+        sample.normal = (reference + sample.distance * sample.direction - center) / radius;
+        return true;
+    }
+
+    Real pdf(const Point3& reference, const Point3& point) const override {
+        Real one_minus_cos_max;
+        return cone((center - reference).lengthSquared(), one_minus_cos_max)
+               ? 1 / (2 * Real(pi) * one_minus_cos_max) : 0;
+    }
+
+    // Radiance times the area, times pi for the cosine-weighted hemisphere every point emits into
+    [[nodiscard]] Real power() const override {
+        return averageChannel(radiance) * 4 * Real(pi) * radius*radius * Real(pi);
+    }
+
+    [[nodiscard]] AABB bounds() const override {
+        auto r_vec = Vec3(radius, radius, radius);
+        return AABB(center - r_vec, center + r_vec);
+    }
+
+private:
+    Point3 center;
+    Real radius;
+    Color radiance;
+
+    // One minus the cosine of the half angle of the cone the sphere subtends from the given squared distance, in a
+    // form that keeps its precision for small, distant spheres. False from inside, where no emission is seen.
+    [[nodiscard]] bool cone(Real distance_squared, Real& one_minus_cos_max) const {
+        auto sin_squared_max = radius*radius / distance_squared;
+        if (!(sin_squared_max < 1)) {
+            return false;
+        }
+        one_minus_cos_max = sin_squared_max / (1 + sqrt(1 - sin_squared_max));
+        return true;
+    }
+};
+
+// Parallelogram Q + a*u + b*v for a, b in [0, 1], emitting on the side cross(u, v) points to and sampled uniformly
+// by area
+class QuadLight : public Light {
+public:
+    QuadLight(const Point3& _q, const Vec3& _u, const Vec3& _v, const Color& _radiance)
+        : q(_q), u(_u), v(_v), radiance(_radiance) {
+        auto n = cross(u, v);
+        area = n.length();
+        normal = n / area;
+    }
+
+    bool sample(const Point3& reference, Real u1, Real u2, LightSample& sample) const override {
+        Vec3 to_point = q + u1*u + u2*v - reference;
+        auto distance_squared = to_point.lengthSquared();
+        sample.distance = sqrt(distance_squared);
+        sample.direction = to_point / sample.distance;
+        auto cos_light = -dot(normal, sample.direction);
+        if (!(cos_light > 0)) {
+            return false;
+        }
+        sample.pdf = distance_squared / (cos_light * area);
+        sample.radiance = radiance;
+        sample.normal = normal;
+        return true;
+    }
+
+    Real pdf(const Point3& reference, const Point3& point) const override {
+        Vec3 to_point = point - reference;
+        auto distance_squared = to_point.lengthSquared();
+        auto cos_light = -dot(normal, to_point) / sqrt(distance_squared);
+        return cos_light > 0 ? distance_squared / (cos_light * area) : 0;
+    }
+
+    [[nodiscard]] Real power() const override { return averageChannel(radiance) * area * Real(pi); }
+
+    [[nodiscard]] AABB bounds() const override { return AABB(AABB(q, q + u + v), AABB(q + u, q + v)); }
+
+private:
+    Point3 q;
+    Vec3 u, v;
+    Vec3 normal;
+    Real area;
+    Color radiance;
+};
+
+// How LightList::pick() chooses among the lights: evenly, in proportion to their power with an alias table, or by
+// their estimated contribution at the shading point with a LightBvh
+enum class LightSampling { Uniform, Power, Bvh };
+
+// Every light of a scene, gathered by Hittable::collectLights(). Each light is also a primitive in the scene, and
+// is found again from a hit on it to weigh the emission that paths reach by scattering. build() prepares the
+// chosen selection strategy once every light is added.
+class LightList {
+public:
+    void add(shared_ptr<Light> light, const Hittable* object, uint32_t primitive) {
+        index[PrimitiveKey{object, primitive}] = static_cast<uint32_t>(lights.size());
+        lights.push_back(std::move(light));
+    }
+
+    [[nodiscard]] size_t size() const { return lights.size(); }
+
+    [[nodiscard]] bool empty() const { return lights.empty(); }
+
+    const Light& operator[](size_t i) const { return *lights[i]; }
+
+    void build(LightSampling _sampling) {
+        sampling = _sampling;
+        power_table = AliasTable();
+        hierarchy = LightBvh();
+
+        if (sampling == LightSampling::Power) {
+            std::vector<Real> powers(lights.size());
+            for (size_t i = 0; i < lights.size(); ++i) {
+                powers[i] = lights[i]->power();
+            }
+            power_table = AliasTable(powers);
+        } else if (sampling == LightSampling::Bvh) {
+            std::vector<AABB> bounds(lights.size());
+            std::vector<Real> powers(lights.size());
+            for (size_t i = 0; i < lights.size(); ++i) {
+                bounds[i] = lights[i]->bounds();
+                powers[i] = lights[i]->power();
+            }
+            hierarchy = LightBvh(bounds, powers);
+        }
+    }
+
+    // Picks a light for the shading point `reference` with a uniform number, returning its index
+    [[nodiscard]] size_t pick(const Point3& reference, Real u, Real& probability) const {
+        if (sampling == LightSampling::Power) {
+            auto i = power_table.sample(u);
+            probability = power_table.probability(i);
+            return i;
+        }
+        if (sampling == LightSampling::Bvh) {
+            return hierarchy.sample(reference, u, probability);
+        }
+        probability = Real(1) / lights.size();
+        return std::min(static_cast<size_t>(u * lights.size()), lights.size() - 1);
+    }
+
+    // Probability with which pick() returns light i for the shading point `reference`
+    [[nodiscard]] Real probability(size_t i, const Point3& reference) const {
+        if (sampling == LightSampling::Power) {
+            return power_table.probability(i);
+        }
+        if (sampling == LightSampling::Bvh) {
+            return hierarchy.probability(i, reference);
+        }
+        return Real(1) / lights.size();
+    }
+
+    // Index of the light that is the given primitive of object, or -1 if it is not a light
+    [[nodiscard]] int64_t find(const Hittable* object, uint32_t primitive) const {
+        auto it = index.find(PrimitiveKey{object, primitive});
+        return it == index.end() ? -1 : it->second;
+    }
+
+private:
+    struct PrimitiveKey {
+        const Hittable* object;
+        uint32_t primitive;
+
+        bool operator==(const PrimitiveKey& other) const {
+            return object == other.object && primitive == other.primitive;
+        }
+    };
+
+    struct PrimitiveKeyHash {
+        size_t operator()(const PrimitiveKey& key) const {
+            return std::hash<const Hittable*>()(key.object) ^ (key.primitive * size_t(0x9e3779b97f4a7c15ULL));
+        }
+    };
+
+    std::vector<shared_ptr<Light>> lights;
+    LightSampling sampling = LightSampling::Uniform;
+    AliasTable power_table;
+    LightBvh hierarchy;
+    std::unordered_map<PrimitiveKey, uint32_t, PrimitiveKeyHash> index;
+};
+
+#endif //RAYTRACER_LIGHT_H
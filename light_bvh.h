@@ -0,0 +1,143 @@
+#ifndef RAYTRACER_LIGHT_BVH_H
+#define RAYTRACER_LIGHT_BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "aabb.h"
+
+// Binary hierarchy over the bounds and powers of a scene's lights that picks a light by its estimated contribution
+// at a shading point. Each node is weighed by its power over the squared distance to its center, no less than the
+// squared half diagonal of its box, and the descent from the root takes each child with probability proportional to
+// its weight. Near lights are thus preferred over bright far ones, which a choice by power alone cannot do.
+// Emission is treated as reaching every direction.
+class LightBvh {
+public:
+    LightBvh() = default;
+
+    LightBvh(const std::vector<AABB>& bounds, const std::vector<Real>& powers) {
+        auto n = bounds.size();
+        trails.resize(n);
+        depths.resize(n);
+        if (n == 0) {
+            return;
+        }
+
+        std::vector<uint32_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        nodes.reserve(2*n - 1);
+        nodes.emplace_back();
+        build(0, order.data(), order.data() + n, bounds, powers, 0, 0);
+    }
+
+    [[nodiscard]] bool empty() const { return nodes.empty(); }
+
+    // Light picked by the uniform number u for the given shading point, and the probability of picking it
+    [[nodiscard]] size_t sample(const Point3& reference, Real u, Real& probability) const {
+        probability = 1;
+        uint32_t n = 0;
+        while (!nodes[n].leaf) {
+            auto left = nodes[n].child;
+            auto p_left = leftProbability(left, reference);
+            // The part of u that made the choice is scaled back to [0, 1) for the levels below
+            if (u < p_left) {
+                u /= p_left;
+                probability *= p_left;
+                n = left;
+            } else {
+                u = std::min((u - p_left) / (1 - p_left), Real(1) - std::numeric_limits<Real>::epsilon());
+                probability *= 1 - p_left;
+                n = left + 1;
+            }
+        }
+        return nodes[n].child;
+    }
+
+    // Probability with which sample() picks `light` for the given shading point, following the path to its leaf
+    [[nodiscard]] Real probability(size_t light, const Point3& reference) const {
+        Real probability = 1;
+        uint32_t n = 0;
+        for (int level = 0; level < depths[light]; ++level) {
+            auto left = nodes[n].child;
+            auto p_left = leftProbability(left, reference);
+            if ((trails[light] >> level) & 1) {
+                probability *= 1 - p_left;
+                n = left + 1;
+            } else {
+                probability *= p_left;
+                n = left;
+            }
+        }
+        return probability;
+    }
+
+private:
+    // Only what the importance of a node needs, kept precomputed since every pick evaluates two nodes per level
+    struct Node {
+        Point3 center; // Of the node's box
+        Real extent_squared; // Squared half diagonal of the box, the least squared distance importance assumes
+        Real power;
+        uint32_t child; // First of the two children of an interior node, which are adjacent, or a leaf's light
+        bool leaf;
+    };
+
+    std::vector<Node> nodes;
+    // Path from the root to each light's leaf, one bit per level with 1 for the second child, and its length
+    std::vector<uint64_t> trails;
+    std::vector<uint8_t> depths;
+
+    // Splits the lights at the median centroid along the longest axis of their centroids, so the depth stays within
+    // log2 of the light count
+    void build(uint32_t n, uint32_t* first, uint32_t* last, const std::vector<AABB>& bounds,
+               const std::vector<Real>& powers, int depth, uint64_t trail) {
+        AABB box, centroid_box;
+        Real power = 0;
+        for (auto* l = first; l != last; ++l) {
+            box = AABB(box, bounds[*l]);
+            auto c = bounds[*l].centroid();
+            centroid_box = AABB(centroid_box, AABB(c, c));
+            power += powers[*l];
+        }
+        nodes[n].center = box.centroid();
+        nodes[n].extent_squared = Vec3(box.x.size(), box.y.size(), box.z.size()).lengthSquared() / 4;
+        nodes[n].power = power;
+
+        if (last - first == 1) {
+            nodes[n].child = *first;
+            nodes[n].leaf = true;
+            trails[*first] = trail;
+            depths[*first] = static_cast<uint8_t>(depth);
+            return;
+        }
+
+        auto axis = centroid_box.longestAxis();
+        auto* middle = first + (last - first) / 2;
+        std::nth_element(first, middle, last, [&](uint32_t a, uint32_t b) {
+            return bounds[a].centroid()[axis] < bounds[b].centroid()[axis];
+        });
+
+        auto left = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[n].child = left;
+        nodes[n].leaf = false;
+        build(left, first, middle, bounds, powers, depth + 1, trail);
+        build(left + 1, middle, last, bounds, powers, depth + 1, trail | (uint64_t(1) << depth));
+    }
+
+    [[nodiscard]] static Real importance(const Node& node, const Point3& reference) {
+        return node.power / std::max((node.center - reference).lengthSquared(), node.extent_squared);
+    }
+
+    // Probability of taking the first of the children starting at `left`. Children that both estimate nothing are
+    // taken evenly.
+    [[nodiscard]] Real leftProbability(uint32_t left, const Point3& reference) const {
+        auto a = importance(nodes[left], reference);
+        auto b = importance(nodes[left + 1], reference);
+        return a + b > 0 ? a / (a + b) : Real(0.5);
+    }
+};
+
+#endif //RAYTRACER_LIGHT_BVH_H
@@ -2,67 +2,188 @@
 #include "mathutils.h"
 #include "hittable_list.h"
 #include "sphere.h"
+#include "quad.h"
+#include "sphere_set.h"
 #include "camera.h"
+#include "wide_bvh.h"
 
 int main(int argc, char* argv[]) {
+    Camera cam;
+    std::string scene = "spheres";
+    int frames = 1;
+    std::string environment_path;
+
+    if (argc > 1) {
+        if (argc < 6) {
+            std::cerr << "Usage: " << argv[0] << " <image_width> <image_height> <samples_per_pixel> <max_depth> <threads> [--tile-size N] [--adaptive threshold] [--sampler independent|sobol|bluenoise] [--packet-size N] [--integrator path|wavefront|wavefront-binned|ao] [--rays-in-flight N] [--scene spheres|lights|emitters] [--light-sampling uniform|power|bvh] [--restir candidates] [--frames N] [--env environment.pfm|.hdr] [--simulate-cache]\n";
+            return 1;
+        }
+        std::size_t pos;
+        cam.image_width = std::stoi(argv[1], &pos, 0);
+        cam.image_height = std::stoi(argv[2], &pos, 0);
+        cam.samples_per_pixel = std::stoi(argv[3], &pos, 0);
+        cam.max_depth = std::stoi(argv[4], &pos, 0);
+        cam.max_threads = std::stoi(argv[5], &pos, 0);
 
+        // The optional settings are named, each followed by its value except for the --simulate-cache flag
+        for (int a = 6; a < argc; ++a) {
+            std::string option = argv[a];
+            if (option == "--simulate-cache") {
+                cam.simulate_cache = true;
+                continue;
+            }
+            if (a + 1 >= argc) {
+                std::cerr << "Missing value for " << option << "\n";
+                return 1;
+            }
+            std::string value = argv[++a];
+
+            if (option == "--tile-size") {
+                cam.tile_size = std::stoi(value, &pos, 0);
+            } else if (option == "--adaptive") {
+                cam.adaptive_threshold = std::stod(value, &pos);
+            } else if (option == "--sampler") {
+                if (value == "independent") {
+                    cam.sampler_type = SamplerType::Independent;
+                } else if (value == "sobol") {
+                    cam.sampler_type = SamplerType::Sobol;
+                } else if (value == "bluenoise") {
+                    cam.sampler_type = SamplerType::BlueNoise;
+                } else {
+                    std::cerr << "Unknown sampler " << value << "\n";
+                    return 1;
+                }
+            } else if (option == "--packet-size") {
+                cam.packet_size = std::stoi(value, &pos, 0);
+            } else if (option == "--integrator") {
+                if (value == "path") {
+                    cam.integrator = Integrator::Path;
+                } else if (value == "wavefront" || value == "wavefront-binned") {
+                    cam.integrator = Integrator::Wavefront;
+                    cam.bin_secondary_rays = value == "wavefront-binned";
+                } else if (value == "ao") {
+                    cam.integrator = Integrator::AmbientOcclusion;
+                } else {
+                    std::cerr << "Unknown integrator " << value << "\n";
+                    return 1;
+                }
+            } else if (option == "--rays-in-flight") {
+                cam.rays_in_flight = std::stoi(value, &pos, 0);
+            } else if (option == "--scene") {
+                scene = value;
+                if (scene != "spheres" && scene != "lights" && scene != "emitters") {
+                    std::cerr << "Unknown scene " << scene << "\n";
+                    return 1;
+                }
+            } else if (option == "--light-sampling") {
+                if (value == "uniform") {
+                    cam.light_sampling = LightSampling::Uniform;
+                } else if (value == "power") {
+                    cam.light_sampling = LightSampling::Power;
+                } else if (value == "bvh") {
+                    cam.light_sampling = LightSampling::Bvh;
+                } else {
+                    std::cerr << "Unknown light sampling " << value << "\n";
+                    return 1;
+                }
+            } else if (option == "--restir") {
+                cam.resampling_candidates = std::stoi(value, &pos, 0);
+            } else if (option == "--frames") {
+                frames = std::stoi(value, &pos, 0);
+            } else if (option == "--env") {
+                environment_path = value;
+            } else {
+                std::cerr << "Unknown option " << option << "\n";
+                return 1;
+            }
+        }
+        if (cam.resampling_candidates > 0 && (cam.integrator != Integrator::Path || cam.adaptive_threshold > 0)) {
+            std::cerr << "Light resampling works with the path integrator and without adaptive sampling only\n";
+            return 1;
+        }
+    }
 
     HittableList world;
+    MaterialTable materials;
 
-    auto ground_Material = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    auto ground_Material = materials.add(make_shared<Lambertian>(Color(0.5, 0.5, 0.5)));
     world.add(make_shared<Sphere>(Point3(0,-1000,0), 1000, ground_Material));
 
+    // Everything except the ground is kept in one SoA set with its own hierarchy, built below
+    SphereSet spheres;
+
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
             auto choose_mat = randomDouble();
             Point3 center(a + 0.9*randomDouble(), 0.2 + 0.6*randomDouble(), b + 0.9*randomDouble());
 
             if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<Material> Sphere_Material;
+                MaterialId Sphere_Material;
 
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = Color::random() * Color::random();
-                    Sphere_Material = make_shared<Lambertian>(albedo);
-                    world.add(make_shared<Sphere>(center, 0.2, Sphere_Material));
+                    Sphere_Material = materials.add(make_shared<Lambertian>(albedo));
+                    spheres.add(center, 0.2, Sphere_Material);
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = Color::random(0.5, 1);
                     auto fuzz = randomDouble(0, 0.5);
-                    Sphere_Material = make_shared<Metal>(albedo, fuzz);
-                    world.add(make_shared<Sphere>(center, 0.2, Sphere_Material));
+                    Sphere_Material = materials.add(make_shared<Metal>(albedo, fuzz));
+                    spheres.add(center, 0.2, Sphere_Material);
                 } else {
                     // glass
-                    Sphere_Material = make_shared<Dielectric>(1.5);
-                    world.add(make_shared<Sphere>(center, 0.2, Sphere_Material));
+                    Sphere_Material = materials.add(make_shared<Dielectric>(1.5));
+                    spheres.add(center, 0.2, Sphere_Material);
                 }
             }
         }
     }
 
-    auto material1 = make_shared<Dielectric>(1.5);
-    world.add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+    auto material1 = materials.add(make_shared<Dielectric>(1.5));
+    spheres.add(Point3(0, 1, 0), 1.0, material1);
 
-    auto material2 = make_shared<Lambertian>(Color (0.9, 0.2, 0.2));
-    world.add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+    auto material2 = materials.add(make_shared<Lambertian>(Color (0.9, 0.2, 0.2)));
+    spheres.add(Point3(-4, 1, 0), 1.0, material2);
 
-    auto material3 = make_shared<Metal>(Color (0.5, 0.6, 0.9), 0.0);
-    world.add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+    auto material3 = materials.add(make_shared<Metal>(Color (0.5, 0.6, 0.9), 0.0));
+    spheres.add(Point3(4, 1, 0), 1.0, material3);
     Color::random(0.5, 1);
 
-    Camera cam;
+    if (scene == "lights") {
+        // The same field at night, lit by a small lamp and a panel overhead. Most surfaces only receive light from
+        // these two small sources, which scattered rays rarely find on their own.
+        cam.sky_brightness = 0.02;
+        auto lamp = materials.add(make_shared<DiffuseLight>(Color(60, 45, 30)));
+        world.add(make_shared<Sphere>(Point3(2, 2.5, 2), 0.2, lamp));
+        auto panel = materials.add(make_shared<DiffuseLight>(Color(8, 8, 10)));
+        world.add(make_shared<Quad>(Point3(-2, 4, -1), Vec3(2, 0, 0), Vec3(0, 0, 2), panel));
+    } else if (scene == "emitters") {
+        // The field at night under thousands of small glowing spheres spread well beyond it, a few of them far
+        // brighter than the rest. None is right in front of the camera, where it would cover the view out of focus.
+        cam.sky_brightness = 0.02;
+        Point3 camera_position(14, 2, 4);
+        for (int a = -32; a < 32; a++) {
+            for (int b = -32; b < 32; b++) {
+                Point3 center(a + randomDouble(), 1.5 + 1.5*randomDouble(), b + randomDouble());
+                auto brightness = 1 + 80 * pow(randomDouble(), 6);
+                auto radiance = brightness * Color::random(0.3, 1);
+                if ((center - camera_position).length() > 3) {
+                    spheres.add(center, 0.05, materials.add(make_shared<DiffuseLight>(radiance)));
+                }
+            }
+        }
+    }
 
-    if (argc > 1) {
-        if (argc != 6) {
-            std::cerr << "Usage: " << argv[0] << " <image_width> <image_height> <samples_per_pixel> <max_depth> <threads>\n";
+    if (!environment_path.empty()) {
+        int width, height;
+        std::vector<Color> texels;
+        std::string error;
+        if (!readHdrImage(environment_path, width, height, texels, error)) {
+            std::cerr << error << "\n";
             return 1;
         }
-        std::size_t pos;
-        cam.image_width = std::stoi(argv[1], &pos, 0);
-        cam.image_height = std::stoi(argv[2], &pos, 0);
-        cam.samples_per_pixel = std::stoi(argv[3], &pos, 0);
-        cam.max_depth = std::stoi(argv[4], &pos, 0);
-        cam.max_threads = std::stoi(argv[5], &pos, 0);
+        cam.environment = make_shared<EnvironmentMap>(width, height, std::move(texels));
     }
 
     cam.vfov     = 20;
@@ -73,5 +194,33 @@ int main(int argc, char* argv[]) {
     cam.defocus_angle = 0.6;
     cam.focus_distance    = 10.0;
 
-    cam.render(world);
+    spheres.buildHierarchy(cam.threadCount());
+    world.add(make_shared<SphereSet>(std::move(spheres)));
+
+    Bvh8 bvh(world, cam.threadCount());
+    const auto& stats = bvh.stats();
+    std::cout << "Built BVH in " << std::fixed << std::setprecision(2) << stats.build_seconds * 1000.0 << "ms ("
+              << stats.node_count << " nodes, " << stats.leaf_count << " leaves, " << stats.primitive_count
+              << " primitives, " << stats.bytesPerPrimitive() << " bytes/primitive, " << stats.threads << " threads)\n";
+    std::cout << "Using " << simdLevelName(simdLevel()) << " SIMD kernels\n";
+
+    if (frames <= 1) {
+        cam.render(bvh, materials);
+        return 0;
+    }
+
+    // An animation: the camera circles the scene by a degree per frame, each frame written to its own image, and
+    // light resampling reuses the reservoirs each frame ends with in the next
+    cam.temporal_resampling = true;
+    auto start = cam.look_from - cam.look_at;
+    for (int f = 0; f < frames; ++f) {
+        auto angle = degreesToRadians(f);
+        cam.look_from = cam.look_at + Vec3(cos(angle)*start.x() + sin(angle)*start.z(), start.y(),
+                                           -sin(angle)*start.x() + cos(angle)*start.z());
+        cam.frame = f;
+        char name[32];
+        std::snprintf(name, sizeof(name), "image_%03d.png", f);
+        cam.imageName = name;
+        cam.render(bvh, materials);
+    }
 }
@@ -1,10 +1,15 @@
 #ifndef RAYTRACER_MATERIAL_H
 #define RAYTRACER_MATERIAL_H
 
+#include <algorithm>
+#include <typeindex>
+#include <vector>
+
 #include "mathutils.h"
 #include "hittable_list.h"
 #include "color.h"
 #include "hittable.h"
+#include "sampler.h"
 
 class HitRecord;
 
@@ -12,25 +17,49 @@ class Material {
 public:
     virtual ~Material() = default;
 
-    virtual bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const = 0;
+    virtual bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered,
+                         Sampler& sampler) const = 0;
+
+    // BSDF times the cosine to the normal for light arriving from the unit vector `direction` and leaving along
+    // ray_in reversed. Materials that scatter into isolated directions, such as mirrors, keep the default of zero, so
+    // light sampling never reaches them and they only see lights through scatter().
+    virtual Color evaluate(const Ray& ray_in, const HitRecord& record, const Vec3& direction) const {
+        return Color(0, 0, 0);
+    }
+
+    // Density per unit solid angle with which scatter() picks the unit vector `direction`, 0 where evaluate() is
+    virtual Real scatterPdf(const Ray& ray_in, const HitRecord& record, const Vec3& direction) const {
+        return 0;
+    }
+
+    // Radiance leaving the front face of every surface with this material
+    virtual Color emission() const {
+        return Color(0, 0, 0);
+    }
 };
 
 class Lambertian : public Material {
 public:
     Lambertian(const Color& _albedo) : albedo(_albedo) {}
 
-    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const override {
-        auto scatter_dir = record.normal + randomUnitVector();
+    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered,
+                 Sampler& sampler) const override {
+        auto direction_sample = sampler.get2D();
+        auto scatter_dir = sampleCosineHemisphere(record.normal, direction_sample.u, direction_sample.v);
 
-        if (scatter_dir.nearZero()) {
-            scatter_dir = record.normal;
-        }
-
-        scattered = Ray(record.point, scatter_dir);
+        scattered = record.spawnRay(scatter_dir);
         attenuation = albedo;
         return true;
     }
 
+    Color evaluate(const Ray& ray_in, const HitRecord& record, const Vec3& direction) const override {
+        return albedo * scatterPdf(ray_in, record, direction);
+    }
+
+    Real scatterPdf(const Ray& ray_in, const HitRecord& record, const Vec3& direction) const override {
+        return fmax(Real(0), dot(record.normal, direction)) / Real(pi);
+    }
+
 private:
     Color albedo;
 };
@@ -39,9 +68,12 @@ class Metal : public Material {
 public:
     Metal(const Color& _albedo, double fuzziness) : albedo(_albedo), fuzz(fuzziness < 1 ? fuzziness : 1) {}
 
-    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const override {
+    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered,
+                 Sampler& sampler) const override {
         Vec3 reflected = reflect(unitVector(ray_in.direction()), record.normal);
-        scattered = Ray(record.point, reflected + fuzz*randomInUnitSphere());
+        auto fuzz_sample = sampler.get2D();
+        auto fuzz_radius = sampler.get1D();
+        scattered = record.spawnRay(reflected + fuzz*sampleUnitBall(fuzz_sample.u, fuzz_sample.v, fuzz_radius));
         attenuation = albedo;
 
         return (dot(scattered.direction(), record.normal) > 0);
@@ -50,43 +82,92 @@ public:
 
 private:
     Color albedo;
-    double fuzz;
+    Real fuzz;
 };
 
 class Dielectric : public Material {
 public:
     Dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
-    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered) const override{
+    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered,
+                 Sampler& sampler) const override {
         attenuation = Color(1.0, 1.0, 1.0);
-        double refraction_ratio = record.front_face ? (1.0 / ir) : ir;
+        Real refraction_ratio = record.front_face ? (1 / ir) : ir;
 
         Vec3 unit_direction = unitVector(ray_in.direction());
-        double cos_theta = fmin(dot(-unit_direction, record.normal), 1.0);
-        double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+        Real cos_theta = fmin(dot(-unit_direction, record.normal), Real(1));
+        Real sin_theta = sqrt(1 - cos_theta*cos_theta);
 
-        bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+        bool cannot_refract = refraction_ratio * sin_theta > 1;
         Vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > randomDouble()) {
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > sampler.get1D()) {
             direction = reflect(unit_direction, record.normal);
         } else {
             direction = refract(unit_direction, record.normal, refraction_ratio);
         }
 
-        scattered = Ray(record.point, direction);
+        scattered = record.spawnRay(direction);
         return true;
     }
 
 private:
-    double ir; // Index of refraction
+    Real ir; // Index of refraction
 
-    static double reflectance(double cosine, double i_of_ref) {
+    static Real reflectance(Real cosine, Real i_of_ref) {
         // Use Schlick's approximation for reflectance
         auto r0 = (1 - i_of_ref) / (1 + i_of_ref);
         r0 = r0*r0;
-        return r0 + (1-r0)*pow((1 - cosine), 5);
+        return r0 + (1-r0)*pow((1 - cosine), Real(5));
+    }
+};
+
+// Emits `radiance` from its front face and scatters nothing
+class DiffuseLight : public Material {
+public:
+    DiffuseLight(const Color& _radiance) : radiance(_radiance) {}
+
+    bool scatter(const Ray& ray_in, const HitRecord& record, Color& attenuation, Ray& scattered,
+                 Sampler& sampler) const override {
+        return false;
     }
+
+    Color emission() const override { return radiance; }
+
+private:
+    Color radiance;
+};
+
+// Scene-owned storage for every material. Primitives and hit records refer to materials by MaterialId, so
+// intersecting and shading never touch a shared_ptr reference count.
+class MaterialTable {
+public:
+    MaterialId add(shared_ptr<Material> material) {
+        materials.push_back(std::move(material));
+        return static_cast<MaterialId>(materials.size() - 1);
+    }
+
+    [[nodiscard]] size_t size() const { return materials.size(); }
+
+    const Material& operator[](MaterialId id) const { return *materials[id]; }
+
+    // Index of every material's concrete type, numbered in order of first appearance. Sorting hits by it shades each
+    // type of material in one run, so the calls to scatter() are to the same code throughout the run.
+    [[nodiscard]] std::vector<uint32_t> typeIndices() const {
+        std::vector<std::type_index> types;
+        std::vector<uint32_t> indices;
+        for (const auto& material : materials) {
+            auto type = std::find(types.begin(), types.end(), std::type_index(typeid(*material)));
+            indices.push_back(static_cast<uint32_t>(type - types.begin()));
+            if (type == types.end()) {
+                types.emplace_back(typeid(*material));
+            }
+        }
+        return indices;
+    }
+
+private:
+    std::vector<shared_ptr<Material>> materials;
 };
 
 #endif //RAYTRACER_MATERIAL_H
@@ -4,12 +4,21 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <random>
+
+#include "rng.h"
 
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// Scalar type of the geometry and shading math. Configuring with RAYTRACER_FLOAT renders in single precision, which
+// doubles the lanes of every SIMD kernel and halves the memory taken by rays, hits and primitive data.
+#if defined(RAYTRACER_FLOAT)
+using Real = float;
+#else
+using Real = double;
+#endif
+
 // Constants
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
@@ -19,18 +28,20 @@ inline double degreesToRadians(double degrees) {
     return degrees * (pi / 180.0);
 }
 
+// Generator of the calling thread, for code without an Rng of its own such as scene setup
+inline Rng& threadRng() {
+    thread_local Rng rng;
+    return rng;
+}
+
 // Returns a random real in [0, 1).
-inline double randomDouble() {
-    std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+inline double randomDouble(Rng& rng = threadRng()) {
+    return rng.nextDouble();
 }
 
 // Returns a random real in [min, max).
-inline double randomDouble(double min, double max) {
-    std::uniform_real_distribution<double> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+inline double randomDouble(double min, double max, Rng& rng = threadRng()) {
+    return min + (max - min) * rng.nextDouble();
 }
 
 #endif //RAYTRACER_MATHUTILS_H
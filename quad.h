@@ -0,0 +1,77 @@
+#ifndef RAYTRACER_QUAD_H
+#define RAYTRACER_QUAD_H
+
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+
+// Parallelogram with corner Q and edges u and v. Its front face is the side cross(u, v) points to.
+class Quad : public Hittable {
+public:
+    Quad(const Point3& _q, const Vec3& _u, const Vec3& _v, MaterialId _material)
+        : q(_q), u(_u), v(_v), material(_material) {
+        auto n = cross(u, v);
+        normal = unitVector(n);
+        plane_offset = dot(normal, q);
+        w = n / dot(n, n);
+
+        // Flat boxes are padded so that every slab has some thickness
+        auto padding = Vec3(1e-4, 1e-4, 1e-4);
+        bbox = AABB(AABB(q - padding, q + u + v + padding), AABB(q + u - padding, q + v + padding));
+    }
+
+    bool hit(const Ray &ray, Interval ray_t, HitRecord& rec) const override {
+        auto denominator = dot(normal, ray.direction());
+        if (fabs(denominator) < Real(1e-12)) {
+            return false; // Parallel to the plane
+        }
+
+        auto t = (plane_offset - dot(normal, ray.origin())) / denominator;
+        if (!ray_t.surrounds(t)) {
+            return false;
+        }
+
+        // Coordinates of the hit along the edges
+        Vec3 planar = ray.at(t) - q;
+        auto alpha = dot(w, cross(planar, v));
+        auto beta = dot(w, cross(u, planar));
+        if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1) {
+            return false;
+        }
+
+        rec.t = t;
+        rec.object = this;
+        rec.primitive = 0;
+        return true;
+    }
+
+    void finalizeHit(const Ray& ray, HitRecord& rec) const override {
+        rec.point = ray.at(rec.t);
+        // The point carries the rounding of the ray's origin and of t times its direction
+        auto extent = [](const Vec3& x) { return fmax(fmax(fabs(x.x()), fabs(x.y())), fabs(x.z())); };
+        rec.point_error = 8 * std::numeric_limits<Real>::epsilon()
+                          * (extent(ray.origin()) + fabs(rec.t) * extent(ray.direction()) + extent(rec.point));
+        rec.setFaceNormal(ray, normal);
+        rec.material = material;
+    }
+
+    void collectLights(const MaterialTable& materials, LightList& lights) const override {
+        auto emission = materials[material].emission();
+        if (!emission.nearZero()) {
+            lights.add(make_shared<QuadLight>(q, u, v, emission), this, 0);
+        }
+    }
+
+    AABB boundingBox() const override { return bbox; }
+
+private:
+    Point3 q;
+    Vec3 u, v;
+    Vec3 normal;
+    Real plane_offset; // Of the plane through the quad along its normal
+    Vec3 w; // Turns the cross products of an in-plane vector with the edges into edge coordinates
+    MaterialId material;
+    AABB bbox;
+};
+
+#endif //RAYTRACER_QUAD_H
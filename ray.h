@@ -3,22 +3,35 @@
 
 #include "vec3.h"
 
-class Ray {
+template<typename T>
+class RayT {
 public:
-    Ray() {}
+    RayT() {}
 
-    Ray(const Point3& origin, const Vec3& direction) : orig(origin), dir(direction) {}
+    RayT(const Vec3T<T>& origin, const Vec3T<T>& direction) : orig(origin), dir(direction) {}
 
-    Point3 origin() const { return orig;}
-    Vec3 direction() const { return dir;}
+    Vec3T<T> origin() const { return orig;}
+    Vec3T<T> direction() const { return dir;}
 
-    Point3 at(double t) const {
+    Vec3T<T> at(T t) const {
         return orig + t*dir;
     }
 
 private:
-    Point3 orig;
-    Vec3 dir;
+    Vec3T<T> orig;
+    Vec3T<T> dir;
 };
 
+using Ray = RayT<Real>;
+
+// Origin for a ray leaving a surface point p, whose distance from the true surface is at most `error`, on the side
+// of the unit normal n. It is moved along n by the error plus the rounding of the move itself, so it always lands
+// on that side: the new ray never hits the surface it starts on and can be traced from t = 0 in any precision
+// (Pharr et al., "Physically Based Rendering", 3rd edition, section 3.9).
+template<typename T>
+inline Vec3T<T> offsetRayOrigin(const Vec3T<T>& p, const Vec3T<T>& n, T error) {
+    auto magnitude = fmax(fmax(fabs(p.x()), fabs(p.y())), fabs(p.z()));
+    return p + (error + std::numeric_limits<T>::epsilon() * magnitude) * n;
+}
+
 #endif //RAYTRACER_RAY_H
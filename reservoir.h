@@ -0,0 +1,51 @@
+#ifndef RAYTRACER_RESERVOIR_H
+#define RAYTRACER_RESERVOIR_H
+
+#include "color.h"
+#include "vec3.h"
+
+// Point on a light held by a reservoir, with everything needed to shade any surface point with it
+struct LightCandidate {
+    Point3 point;
+    Vec3 normal; // Of the light's surface, on the side it emits from
+    Color radiance;
+};
+
+// Weighted reservoir sampling over light candidates, for resampled importance sampling of direct light (Talbot et
+// al. 2005) and its reuse between pixels and passes (Bitterli et al., "Spatiotemporal reservoir resampling for
+// real-time ray tracing with dynamic direct lighting", 2020). Candidates stream through update(), each kept with
+// probability proportional to its resampling weight, so one pass over any number of them keeps a single sample
+// distributed roughly like the target function. Weights are per unit area of the light, so reservoirs of different
+// surface points can be combined.
+struct LightReservoir {
+    LightCandidate sample;
+    Real target = 0; // Target function of the kept sample at the reservoir's surface point
+    Real weight_sum = 0; // Of every resampling weight seen
+    Real count = 0; // Candidates the reservoir stands for
+    Real contribution_weight = 0; // Estimate of 1 / density of the kept sample, 0 when there is none
+
+    // Considers a candidate with the given resampling weight and target, keeping it if u (uniform in [0, 1)) falls
+    // within its share of the weights seen so far. Leaves count alone.
+    bool update(const LightCandidate& candidate, Real candidate_target, Real weight, Real u) {
+        if (!(weight > 0)) {
+            return false;
+        }
+        weight_sum += weight;
+        if (u * weight_sum < weight) {
+            sample = candidate;
+            target = candidate_target;
+            return true;
+        }
+        return false;
+    }
+
+    // Sets the contribution weight once every candidate is in, given the number of candidates that could have
+    // produced the kept sample
+    void finalize(Real support_count) {
+        contribution_weight = target > 0 && support_count > 0 ? weight_sum / (support_count * target) : 0;
+    }
+
+    [[nodiscard]] bool empty() const { return !(contribution_weight > 0); }
+};
+
+#endif //RAYTRACER_RESERVOIR_H
@@ -0,0 +1,70 @@
+#ifndef RAYTRACER_RNG_H
+#define RAYTRACER_RNG_H
+
+#include <cstdint>
+
+// PCG32 random number generator (XSH RR output on a 64-bit LCG). The whole state is 16 bytes, so every render
+// thread owns one and no generator is ever shared between threads. Different streams with the same seed give
+// independent sequences.
+class Rng {
+public:
+    explicit Rng(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+        this->seed(seed, stream);
+    }
+
+    void seed(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+        state = 0;
+        increment = (stream << 1u) | 1u;
+        nextUint();
+        state += seed;
+        nextUint();
+    }
+
+    uint32_t nextUint() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + increment;
+        auto xor_shifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        auto rotation = static_cast<uint32_t>(old_state >> 59u);
+        return (xor_shifted >> rotation) | (xor_shifted << ((32u - rotation) & 31u));
+    }
+
+    // Returns a random real in [0, 1) with 32 bits of resolution
+    double nextDouble() {
+        return nextUint() * 0x1p-32;
+    }
+
+    // Returns a random real in [0, 1) with 24 bits of resolution
+    float nextFloat() {
+        return static_cast<float>(nextUint() >> 8u) * 0x1p-24f;
+    }
+
+private:
+    uint64_t state;
+    uint64_t increment;
+};
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011).
+// It has no state: the output is a bijective scramble of a 128-bit counter under a 64-bit key, so any random number
+// of a render can be recomputed on its own from the indices that identify it, in any order and on any thread.
+class Philox {
+public:
+    struct Block {
+        uint32_t v[4];
+    };
+
+    static Block generate(Block counter, uint32_t key0, uint32_t key1) {
+        for (int round = 0; round < 10; ++round) {
+            uint64_t product0 = static_cast<uint64_t>(0xD2511F53U) * counter.v[0];
+            uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57U) * counter.v[2];
+            counter = Block{{static_cast<uint32_t>(product1 >> 32) ^ counter.v[1] ^ key0,
+                             static_cast<uint32_t>(product1),
+                             static_cast<uint32_t>(product0 >> 32) ^ counter.v[3] ^ key1,
+                             static_cast<uint32_t>(product0)}};
+            key0 += 0x9E3779B9U;
+            key1 += 0xBB67AE85U;
+        }
+        return counter;
+    }
+};
+
+#endif //RAYTRACER_RNG_H
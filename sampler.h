@@ -0,0 +1,378 @@
+#ifndef RAYTRACER_SAMPLER_H
+#define RAYTRACER_SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "rng.h"
+
+struct Sample2D {
+    double u, v;
+};
+
+// Source of the uniform numbers a camera sample consumes. Every decision along a path reads a fixed dimension
+// (see setDimension), so low discrepancy samplers can stratify each decision across the samples of a pixel.
+class Sampler {
+public:
+    virtual ~Sampler() = default;
+
+    // Starts sample `index` of pixel (x, y) at dimension 0
+    virtual void startSample(int x, int y, uint32_t index) = 0;
+
+    void setDimension(uint32_t d) { dimension = d; }
+
+    // Returns a number in [0, 1) and moves to the next dimension
+    virtual double get1D() = 0;
+
+    // Returns a point in [0, 1)^2 and moves past both of its dimensions
+    virtual Sample2D get2D() = 0;
+
+protected:
+    uint32_t dimension = 0;
+};
+
+enum class SamplerType { Independent, Sobol, BlueNoise };
+
+// Integer hashing and Owen scrambling, following Burley, "Practical Hash-based Owen Scrambling" (JCGT 2020)
+namespace sampling {
+
+inline uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash(uint32_t a, uint32_t b) {
+    return hash(a ^ (b * 0x9e3779b9U));
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+    x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+    x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+    x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+    return x;
+}
+
+// Random permutation of x in which each bit only depends on the bits below it (Laine-Karras)
+inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return x;
+}
+
+// Owen scrambling of a 0.32 fixed point number: each bit is flipped depending on the bits above it
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+inline double toUnit(uint32_t x) {
+    return x * 0x1p-32;
+}
+
+// First two dimensions of the Sobol sequence as 0.32 fixed point numbers
+inline uint32_t sobol0(uint32_t index) {
+    return reverseBits(index);
+}
+
+// Second dimension contributed by each value of each byte of the index, so a lookup per byte replaces a loop over
+// all 32 bits (a scrambled index has random high bits)
+struct Sobol1Table {
+    uint32_t bytes[4][256];
+
+    constexpr Sobol1Table() : bytes() {
+        uint32_t columns[32] = {};
+        uint32_t v = 1U << 31;
+        for (auto& column : columns) {
+            column = v;
+            v ^= v >> 1;
+        }
+        for (int b = 0; b < 4; ++b) {
+            for (uint32_t value = 0; value < 256; ++value) {
+                uint32_t result = 0;
+                for (int bit = 0; bit < 8; ++bit) {
+                    if (value & (1U << bit)) {
+                        result ^= columns[8 * b + bit];
+                    }
+                }
+                bytes[b][value] = result;
+            }
+        }
+    }
+};
+
+inline constexpr Sobol1Table sobol1_table{};
+
+inline uint32_t sobol1(uint32_t index) {
+    return sobol1_table.bytes[0][index & 0xff] ^ sobol1_table.bytes[1][(index >> 8) & 0xff]
+         ^ sobol1_table.bytes[2][(index >> 16) & 0xff] ^ sobol1_table.bytes[3][index >> 24];
+}
+
+// Sample `index` of an Owen scrambled, shuffled Sobol point set for one dimension (pair). Distinct seeds give
+// uncorrelated sets, which is how every dimension of a path gets its own well stratified sequence ("padding").
+// Owen scrambling the index and then taking the first dimension reduces to one permutation of the reversed index,
+// which saves a pair of bit reversals.
+inline double scrambledSobol1D(uint32_t index, uint32_t seed) {
+    auto shuffled_sobol0 = laineKarrasPermutation(reverseBits(index), seed);
+    return toUnit(reverseBits(laineKarrasPermutation(reverseBits(shuffled_sobol0), hash(seed))));
+}
+
+inline Sample2D scrambledSobol2D(uint32_t index, uint32_t seed) {
+    auto shuffled_sobol0 = laineKarrasPermutation(reverseBits(index), seed);
+    auto shuffled = reverseBits(shuffled_sobol0);
+    auto seed_u = hash(seed);
+    return {toUnit(reverseBits(laineKarrasPermutation(shuffled, seed_u))),
+            toUnit(owenScramble(sobol1(shuffled), hash(seed_u)))};
+}
+
+// Tileable blue noise mask of mask_size^2 values in (0, 1) built with the void and cluster method (Ulichney 1993):
+// points are ranked so that every prefix of the ranking is as evenly spread as possible, then ranks become values.
+class BlueNoiseMask {
+public:
+    static constexpr int mask_size = 64;
+
+    static const BlueNoiseMask& instance() {
+        static const BlueNoiseMask mask;
+        return mask;
+    }
+
+    [[nodiscard]] double value(int x, int y) const {
+        return values[(y & (mask_size - 1)) * mask_size + (x & (mask_size - 1))];
+    }
+
+private:
+    static constexpr int cell_count = mask_size * mask_size;
+
+    std::vector<double> values;
+    std::vector<double> kernel; // Gaussian splat indexed by the toroidal offset between two cells
+    std::vector<double> energy;
+    std::vector<bool> occupied;
+
+    BlueNoiseMask() : values(cell_count), kernel(cell_count), energy(cell_count, 0.0), occupied(cell_count, false) {
+        const double sigma = 1.5;
+        for (int dy = 0; dy < mask_size; ++dy) {
+            for (int dx = 0; dx < mask_size; ++dx) {
+                int wx = std::min(dx, mask_size - dx);
+                int wy = std::min(dy, mask_size - dy);
+                kernel[dy * mask_size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+            }
+        }
+
+        // Initial pattern: 10% random points, relaxed by moving the tightest cluster into the largest void
+        Rng rng(0x5eed);
+        int initial_count = cell_count / 10;
+        for (int placed = 0; placed < initial_count;) {
+            int cell = static_cast<int>(rng.nextUint() % cell_count);
+            if (!occupied[cell]) {
+                toggle(cell);
+                ++placed;
+            }
+        }
+        for (int iteration = 0; iteration < cell_count; ++iteration) {
+            int cluster = tightestCluster();
+            toggle(cluster);
+            int void_cell = largestVoid();
+            toggle(void_cell);
+            if (void_cell == cluster) {
+                break;
+            }
+        }
+        auto initial_occupied = occupied;
+        auto initial_energy = energy;
+
+        std::vector<int> rank(cell_count);
+        for (int r = initial_count - 1; r >= 0; --r) {
+            int cluster = tightestCluster();
+            toggle(cluster);
+            rank[cluster] = r;
+        }
+
+        occupied = initial_occupied;
+        energy = initial_energy;
+        for (int r = initial_count; r < cell_count; ++r) {
+            int void_cell = largestVoid();
+            toggle(void_cell);
+            rank[void_cell] = r;
+        }
+
+        for (int cell = 0; cell < cell_count; ++cell) {
+            values[cell] = (rank[cell] + 0.5) / cell_count;
+        }
+    }
+
+    void toggle(int cell) {
+        double sign = occupied[cell] ? -1.0 : 1.0;
+        occupied[cell] = !occupied[cell];
+        int cx = cell % mask_size, cy = cell / mask_size;
+        for (int y = 0; y < mask_size; ++y) {
+            int dy = (y - cy) & (mask_size - 1);
+            for (int x = 0; x < mask_size; ++x) {
+                int dx = (x - cx) & (mask_size - 1);
+                energy[y * mask_size + x] += sign * kernel[dy * mask_size + dx];
+            }
+        }
+    }
+
+    [[nodiscard]] int tightestCluster() const {
+        int best = -1;
+        for (int cell = 0; cell < cell_count; ++cell) {
+            if (occupied[cell] && (best < 0 || energy[cell] > energy[best])) {
+                best = cell;
+            }
+        }
+        return best;
+    }
+
+    [[nodiscard]] int largestVoid() const {
+        int best = -1;
+        for (int cell = 0; cell < cell_count; ++cell) {
+            if (!occupied[cell] && (best < 0 || energy[cell] < energy[best])) {
+                best = cell;
+            }
+        }
+        return best;
+    }
+};
+
+} // namespace sampling
+
+// Independent uniform numbers, each computed from (frame, pixel, sample index, dimension) by the Philox
+// counter-based generator
+class IndependentSampler : public Sampler {
+public:
+    explicit IndependentSampler(uint32_t _frame = 0) : frame(_frame) {}
+
+    void startSample(int x, int y, uint32_t index) override {
+        pixel_x = static_cast<uint32_t>(x);
+        pixel_y = static_cast<uint32_t>(y);
+        sample_index = index;
+        dimension = 0;
+    }
+
+    double get1D() override {
+        return sampling::toUnit(generate(dimension++).v[0]);
+    }
+
+    Sample2D get2D() override {
+        auto block = generate(dimension);
+        dimension += 2;
+        return {sampling::toUnit(block.v[0]), sampling::toUnit(block.v[1])};
+    }
+
+private:
+    uint32_t frame;
+    uint32_t pixel_x = 0, pixel_y = 0;
+    uint32_t sample_index = 0;
+
+    [[nodiscard]] Philox::Block generate(uint32_t d) const {
+        return Philox::generate(Philox::Block{{pixel_x, pixel_y, sample_index, d}}, frame, 0x5a4d706cU);
+    }
+};
+
+// Owen scrambled Sobol points, with an independent scramble for every frame, pixel and dimension. Converges faster
+// than independent sampling whenever the integrand is reasonably smooth in each dimension.
+class SobolSampler : public Sampler {
+public:
+    explicit SobolSampler(uint32_t frame = 0) : seed(sampling::hash(frame)) {}
+
+    void startSample(int x, int y, uint32_t index) override {
+        pixel_seed = sampling::hash(seed, sampling::hash(static_cast<uint32_t>(x), static_cast<uint32_t>(y)));
+        sample_index = index;
+        dimension = 0;
+    }
+
+    double get1D() override {
+        return sampling::scrambledSobol1D(sample_index, sampling::hash(pixel_seed, dimension++));
+    }
+
+    Sample2D get2D() override {
+        auto sample = sampling::scrambledSobol2D(sample_index, sampling::hash(pixel_seed, dimension));
+        dimension += 2;
+        return sample;
+    }
+
+private:
+    uint32_t seed;
+    uint32_t pixel_seed = 0;
+    uint32_t sample_index = 0;
+};
+
+// The same scrambled Sobol sequence in every pixel, shifted per pixel and dimension by a blue noise mask
+// (Cranley-Patterson rotation). Neighbouring pixels get well spread offsets, so what error remains at low sample
+// counts is pushed to high frequencies and looks much less blotchy than white noise.
+class BlueNoiseSampler : public Sampler {
+public:
+    explicit BlueNoiseSampler(uint32_t frame = 0)
+        : seed(sampling::hash(frame)), mask(sampling::BlueNoiseMask::instance()) {
+        for (uint32_t d = 0; d < cached_dimensions; ++d) {
+            dimension_seeds[d] = sampling::hash(seed, d);
+            mask_offsets[d] = sampling::hash(dimension_seeds[d]);
+        }
+    }
+
+    void startSample(int x, int y, uint32_t index) override {
+        pixel_x = x;
+        pixel_y = y;
+        sample_index = index;
+        dimension = 0;
+    }
+
+    double get1D() override {
+        auto d = dimension++;
+        return rotate(sampling::scrambledSobol1D(sample_index, dimensionSeed(d)), d);
+    }
+
+    Sample2D get2D() override {
+        auto d = dimension;
+        dimension += 2;
+        auto sample = sampling::scrambledSobol2D(sample_index, dimensionSeed(d));
+        return {rotate(sample.u, d), rotate(sample.v, d + 1)};
+    }
+
+private:
+    static constexpr uint32_t cached_dimensions = 64;
+
+    uint32_t seed;
+    const sampling::BlueNoiseMask& mask;
+    uint32_t dimension_seeds[cached_dimensions];
+    uint32_t mask_offsets[cached_dimensions]; // Low and high halves offset the mask lookup in x and y
+    int pixel_x = 0, pixel_y = 0;
+    uint32_t sample_index = 0;
+
+    [[nodiscard]] uint32_t dimensionSeed(uint32_t d) const {
+        return d < cached_dimensions ? dimension_seeds[d] : sampling::hash(seed, d);
+    }
+
+    // Shifts a number by the mask value at a per-dimension offset of the pixel, wrapping into [0, 1)
+    [[nodiscard]] double rotate(double x, uint32_t d) const {
+        auto offset = d < cached_dimensions ? mask_offsets[d] : sampling::hash(dimensionSeed(d));
+        auto shifted = x + mask.value(pixel_x + static_cast<int>(offset & 0xffff),
+                                      pixel_y + static_cast<int>(offset >> 16));
+        return shifted < 1.0 ? shifted : shifted - 1.0;
+    }
+};
+
+// Every sampler is a pure function of (frame, pixel, sample index, dimension), so images are bit identical for any
+// thread count, tile size or tile order, and a frame can be split up or resumed without seams
+inline std::unique_ptr<Sampler> makeSampler(SamplerType type, uint32_t frame = 0) {
+    switch (type) {
+        case SamplerType::Sobol:
+            return std::make_unique<SobolSampler>(frame);
+        case SamplerType::BlueNoise:
+            return std::make_unique<BlueNoiseSampler>(frame);
+        default:
+            return std::make_unique<IndependentSampler>(frame);
+    }
+}
+
+#endif //RAYTRACER_SAMPLER_H
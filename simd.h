@@ -0,0 +1,445 @@
+#ifndef RAYTRACER_SIMD_H
+#define RAYTRACER_SIMD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <type_traits>
+
+#include "mathutils.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Thin wrappers over SIMD registers in double and single precision, with one specialization per instruction set
+// level (a single scalar lane, SSE2, AVX2 or AVX-512). Kernels are written once as templates over the level, and
+// dispatchSimd() runs them at the best level of the CPU they find themselves on, so the same binary uses AVX-512
+// where it exists and still runs on any x86-64 host.
+
+enum class SimdLevel { Scalar, Sse2, Avx2, Avx512 };
+
+// Level the compiler may assume everywhere, from the instruction set flags of the build. Dispatch never goes lower.
+#if defined(__AVX512F__)
+constexpr SimdLevel compiled_simd_level = SimdLevel::Avx512;
+#elif defined(__AVX2__) && defined(__FMA__)
+constexpr SimdLevel compiled_simd_level = SimdLevel::Avx2;
+#elif defined(__SSE2__)
+constexpr SimdLevel compiled_simd_level = SimdLevel::Sse2;
+#else
+constexpr SimdLevel compiled_simd_level = SimdLevel::Scalar;
+#endif
+
+// GCC and Clang can compile single functions for a wider instruction set than the rest of the build, which the AVX2
+// and AVX-512 specializations rely on. Other compilers only get the compiled level.
+#if defined(__SSE2__) && defined(__GNUC__)
+#define RAYTRACER_SIMD_DISPATCH
+#define RAYTRACER_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define RAYTRACER_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#define RAYTRACER_FLATTEN __attribute__((flatten))
+#else
+#define RAYTRACER_FLATTEN
+#endif
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Avx512: return "avx512";
+        case SimdLevel::Avx2: return "avx2";
+        case SimdLevel::Sse2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+// Best level the CPU supports. Setting the RAYTRACER_SIMD environment variable to one of the level names caps it,
+// to compare levels on one machine or to sidestep a misbehaving host.
+inline SimdLevel detectSimdLevel() {
+    auto level = compiled_simd_level;
+#if defined(RAYTRACER_SIMD_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = SimdLevel::Avx512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = std::max(level, SimdLevel::Avx2);
+    }
+#endif
+
+    if (const char* cap = std::getenv("RAYTRACER_SIMD")) {
+        for (auto lower : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+            if (simdLevelName(lower) == std::string(cap)) {
+                level = std::min(level, std::max(lower, compiled_simd_level));
+            }
+        }
+    }
+    return level;
+}
+
+// Level used by objects created from now on, detected once per process
+inline SimdLevel simdLevel() {
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+template<SimdLevel Level>
+using SimdLevelTag = std::integral_constant<SimdLevel, Level>;
+
+namespace simd_detail {
+    template<typename Fn>
+    RAYTRACER_FLATTEN inline decltype(auto) runCompiled(Fn& fn) { return fn(SimdLevelTag<compiled_simd_level>()); }
+
+#if defined(RAYTRACER_SIMD_DISPATCH)
+    template<typename Fn>
+    RAYTRACER_TARGET_AVX2 RAYTRACER_FLATTEN inline decltype(auto) runAvx2(Fn& fn) {
+        return fn(SimdLevelTag<SimdLevel::Avx2>());
+    }
+
+    template<typename Fn>
+    RAYTRACER_TARGET_AVX512 RAYTRACER_FLATTEN inline decltype(auto) runAvx512(Fn& fn) {
+        return fn(SimdLevelTag<SimdLevel::Avx512>());
+    }
+#endif
+}
+
+// Calls fn with a SimdLevelTag of the given level. The call is compiled for that instruction set with everything fn
+// calls inlined into it, so a kernel templated on the level runs entirely in that level's registers. Virtual calls
+// are the boundary: the code behind them dispatches on its own.
+template<typename Fn>
+inline decltype(auto) dispatchSimd(SimdLevel level, Fn&& fn) {
+#if defined(RAYTRACER_SIMD_DISPATCH)
+    if constexpr (compiled_simd_level < SimdLevel::Avx512) {
+        if (level == SimdLevel::Avx512) return simd_detail::runAvx512(fn);
+    }
+    if constexpr (compiled_simd_level < SimdLevel::Avx2) {
+        if (level == SimdLevel::Avx2) return simd_detail::runAvx2(fn);
+    }
+#endif
+    return simd_detail::runCompiled(fn);
+}
+
+template<SimdLevel Level> class SimdDoubleT;
+template<SimdLevel Level> class SimdFloatT;
+
+// SIMD type with lanes of the build's Real type
+template<SimdLevel Level>
+using SimdRealT = std::conditional_t<std::is_same_v<Real, float>, SimdFloatT<Level>, SimdDoubleT<Level>>;
+
+// Lanes of SimdRealT at a level chosen at run time
+inline int simdRealWidth(SimdLevel level) {
+    constexpr int lanes_per_128_bits = 16 / sizeof(Real);
+    switch (level) {
+        case SimdLevel::Avx512: return 4 * lanes_per_128_bits;
+        case SimdLevel::Avx2: return 2 * lanes_per_128_bits;
+        case SimdLevel::Sse2: return lanes_per_128_bits;
+        default: return 1;
+    }
+}
+
+// A single lane, for hosts without SIMD support. Masks are one bit, lowest lane first like the others.
+template<>
+class SimdDoubleT<SimdLevel::Scalar> {
+public:
+    using Native = double;
+    static constexpr int width = 1;
+
+    struct Mask {
+        bool m;
+        [[nodiscard]] unsigned int bits() const { return m ? 1u : 0u; }
+        [[nodiscard]] bool any() const { return m; }
+        friend Mask operator&(Mask a, Mask b) { return Mask{a.m && b.m}; }
+    };
+
+    SimdDoubleT() = default;
+    explicit SimdDoubleT(double x) : v(x) {}
+
+    static SimdDoubleT load(const double* p) { return SimdDoubleT(*p); }
+    void store(double* p) const { *p = v; }
+
+    friend SimdDoubleT operator+(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(a.v + b.v); }
+    friend SimdDoubleT operator-(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(a.v - b.v); }
+    friend SimdDoubleT operator*(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(a.v * b.v); }
+    friend SimdDoubleT operator/(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(a.v / b.v); }
+    friend SimdDoubleT sqrt(SimdDoubleT a) { return SimdDoubleT(std::sqrt(a.v)); }
+    friend SimdDoubleT min(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(a.v < b.v ? a.v : b.v); }
+    friend SimdDoubleT max(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(a.v > b.v ? a.v : b.v); }
+    friend Mask operator<(SimdDoubleT a, SimdDoubleT b) { return Mask{a.v < b.v}; }
+    friend Mask operator>(SimdDoubleT a, SimdDoubleT b) { return Mask{a.v > b.v}; }
+    friend Mask operator>=(SimdDoubleT a, SimdDoubleT b) { return Mask{a.v >= b.v}; }
+    // Lanes of a where the mask is set, b elsewhere
+    friend SimdDoubleT select(Mask mask, SimdDoubleT a, SimdDoubleT b) { return mask.m ? a : b; }
+
+    Native v;
+};
+
+template<>
+class SimdFloatT<SimdLevel::Scalar> {
+public:
+    using Native = float;
+    static constexpr int width = 1;
+
+    using Mask = SimdDoubleT<SimdLevel::Scalar>::Mask;
+
+    SimdFloatT() = default;
+    explicit SimdFloatT(float x) : v(x) {}
+
+    static SimdFloatT load(const float* p) { return SimdFloatT(*p); }
+    void store(float* p) const { *p = v; }
+
+    friend SimdFloatT operator+(SimdFloatT a, SimdFloatT b) { return SimdFloatT(a.v + b.v); }
+    friend SimdFloatT operator-(SimdFloatT a, SimdFloatT b) { return SimdFloatT(a.v - b.v); }
+    friend SimdFloatT operator*(SimdFloatT a, SimdFloatT b) { return SimdFloatT(a.v * b.v); }
+    friend SimdFloatT operator/(SimdFloatT a, SimdFloatT b) { return SimdFloatT(a.v / b.v); }
+    friend SimdFloatT sqrt(SimdFloatT a) { return SimdFloatT(std::sqrt(a.v)); }
+    friend SimdFloatT min(SimdFloatT a, SimdFloatT b) { return SimdFloatT(a.v < b.v ? a.v : b.v); }
+    friend SimdFloatT max(SimdFloatT a, SimdFloatT b) { return SimdFloatT(a.v > b.v ? a.v : b.v); }
+    friend Mask operator<(SimdFloatT a, SimdFloatT b) { return Mask{a.v < b.v}; }
+    friend Mask operator>(SimdFloatT a, SimdFloatT b) { return Mask{a.v > b.v}; }
+    friend Mask operator>=(SimdFloatT a, SimdFloatT b) { return Mask{a.v >= b.v}; }
+    friend SimdFloatT select(Mask mask, SimdFloatT a, SimdFloatT b) { return mask.m ? a : b; }
+
+    Native v;
+};
+
+#if defined(__SSE2__)
+template<>
+class SimdDoubleT<SimdLevel::Sse2> {
+public:
+    using Native = __m128d;
+    static constexpr int width = 2;
+
+    struct Mask {
+        __m128d m;
+        [[nodiscard]] unsigned int bits() const { return static_cast<unsigned int>(_mm_movemask_pd(m)); }
+        [[nodiscard]] bool any() const { return bits() != 0; }
+        friend Mask operator&(Mask a, Mask b) { return Mask{_mm_and_pd(a.m, b.m)}; }
+    };
+
+    SimdDoubleT() = default;
+    explicit SimdDoubleT(Native _v) : v(_v) {}
+    explicit SimdDoubleT(double x) : v(_mm_set1_pd(x)) {}
+
+    static SimdDoubleT load(const double* p) { return SimdDoubleT(_mm_loadu_pd(p)); }
+    void store(double* p) const { _mm_storeu_pd(p, v); }
+
+    friend SimdDoubleT operator+(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm_add_pd(a.v, b.v)); }
+    friend SimdDoubleT operator-(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm_sub_pd(a.v, b.v)); }
+    friend SimdDoubleT operator*(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm_mul_pd(a.v, b.v)); }
+    friend SimdDoubleT operator/(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm_div_pd(a.v, b.v)); }
+    friend SimdDoubleT sqrt(SimdDoubleT a) { return SimdDoubleT(_mm_sqrt_pd(a.v)); }
+    friend SimdDoubleT min(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm_min_pd(a.v, b.v)); }
+    friend SimdDoubleT max(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm_max_pd(a.v, b.v)); }
+    friend Mask operator<(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm_cmplt_pd(a.v, b.v)}; }
+    friend Mask operator>(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm_cmpgt_pd(a.v, b.v)}; }
+    friend Mask operator>=(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm_cmpge_pd(a.v, b.v)}; }
+    friend SimdDoubleT select(Mask mask, SimdDoubleT a, SimdDoubleT b) {
+        return SimdDoubleT(_mm_or_pd(_mm_and_pd(mask.m, a.v), _mm_andnot_pd(mask.m, b.v)));
+    }
+
+    Native v;
+};
+
+template<>
+class SimdFloatT<SimdLevel::Sse2> {
+public:
+    using Native = __m128;
+    static constexpr int width = 4;
+
+    struct Mask {
+        __m128 m;
+        [[nodiscard]] unsigned int bits() const { return static_cast<unsigned int>(_mm_movemask_ps(m)); }
+        [[nodiscard]] bool any() const { return bits() != 0; }
+        friend Mask operator&(Mask a, Mask b) { return Mask{_mm_and_ps(a.m, b.m)}; }
+    };
+
+    SimdFloatT() = default;
+    explicit SimdFloatT(Native _v) : v(_v) {}
+    explicit SimdFloatT(float x) : v(_mm_set1_ps(x)) {}
+
+    static SimdFloatT load(const float* p) { return SimdFloatT(_mm_loadu_ps(p)); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    friend SimdFloatT operator+(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm_add_ps(a.v, b.v)); }
+    friend SimdFloatT operator-(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm_sub_ps(a.v, b.v)); }
+    friend SimdFloatT operator*(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm_mul_ps(a.v, b.v)); }
+    friend SimdFloatT operator/(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm_div_ps(a.v, b.v)); }
+    friend SimdFloatT sqrt(SimdFloatT a) { return SimdFloatT(_mm_sqrt_ps(a.v)); }
+    friend SimdFloatT min(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm_min_ps(a.v, b.v)); }
+    friend SimdFloatT max(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm_max_ps(a.v, b.v)); }
+    friend Mask operator<(SimdFloatT a, SimdFloatT b) { return Mask{_mm_cmplt_ps(a.v, b.v)}; }
+    friend Mask operator>(SimdFloatT a, SimdFloatT b) { return Mask{_mm_cmpgt_ps(a.v, b.v)}; }
+    friend Mask operator>=(SimdFloatT a, SimdFloatT b) { return Mask{_mm_cmpge_ps(a.v, b.v)}; }
+    friend SimdFloatT select(Mask mask, SimdFloatT a, SimdFloatT b) {
+        return SimdFloatT(_mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v)));
+    }
+
+    Native v;
+};
+#endif
+
+// The wider levels compile each member for their own instruction set, so they can be used from the code that
+// dispatchSimd() runs at that level whatever the flags of the build
+#if defined(RAYTRACER_SIMD_DISPATCH)
+#define RAYTRACER_TARGET RAYTRACER_TARGET_AVX2
+
+template<>
+class SimdDoubleT<SimdLevel::Avx2> {
+public:
+    using Native = __m256d;
+    static constexpr int width = 4;
+
+    struct Mask {
+        __m256d m;
+        [[nodiscard]] RAYTRACER_TARGET unsigned int bits() const {
+            return static_cast<unsigned int>(_mm256_movemask_pd(m));
+        }
+        [[nodiscard]] RAYTRACER_TARGET bool any() const { return bits() != 0; }
+        RAYTRACER_TARGET friend Mask operator&(Mask a, Mask b) { return Mask{_mm256_and_pd(a.m, b.m)}; }
+    };
+
+    SimdDoubleT() = default;
+    RAYTRACER_TARGET explicit SimdDoubleT(Native _v) : v(_v) {}
+    RAYTRACER_TARGET explicit SimdDoubleT(double x) : v(_mm256_set1_pd(x)) {}
+
+    RAYTRACER_TARGET static SimdDoubleT load(const double* p) { return SimdDoubleT(_mm256_loadu_pd(p)); }
+    RAYTRACER_TARGET void store(double* p) const { _mm256_storeu_pd(p, v); }
+
+    RAYTRACER_TARGET friend SimdDoubleT operator+(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm256_add_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT operator-(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm256_sub_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT operator*(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm256_mul_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT operator/(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm256_div_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT sqrt(SimdDoubleT a) { return SimdDoubleT(_mm256_sqrt_pd(a.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT min(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm256_min_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT max(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm256_max_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend Mask operator<(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>=(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ)}; }
+    RAYTRACER_TARGET friend SimdDoubleT select(Mask mask, SimdDoubleT a, SimdDoubleT b) {
+        return SimdDoubleT(_mm256_blendv_pd(b.v, a.v, mask.m));
+    }
+
+    Native v;
+};
+
+template<>
+class SimdFloatT<SimdLevel::Avx2> {
+public:
+    using Native = __m256;
+    static constexpr int width = 8;
+
+    struct Mask {
+        __m256 m;
+        [[nodiscard]] RAYTRACER_TARGET unsigned int bits() const {
+            return static_cast<unsigned int>(_mm256_movemask_ps(m));
+        }
+        [[nodiscard]] RAYTRACER_TARGET bool any() const { return bits() != 0; }
+        RAYTRACER_TARGET friend Mask operator&(Mask a, Mask b) { return Mask{_mm256_and_ps(a.m, b.m)}; }
+    };
+
+    SimdFloatT() = default;
+    RAYTRACER_TARGET explicit SimdFloatT(Native _v) : v(_v) {}
+    RAYTRACER_TARGET explicit SimdFloatT(float x) : v(_mm256_set1_ps(x)) {}
+
+    RAYTRACER_TARGET static SimdFloatT load(const float* p) { return SimdFloatT(_mm256_loadu_ps(p)); }
+    RAYTRACER_TARGET void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    RAYTRACER_TARGET friend SimdFloatT operator+(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm256_add_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT operator-(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm256_sub_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT operator*(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm256_mul_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT operator/(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm256_div_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT sqrt(SimdFloatT a) { return SimdFloatT(_mm256_sqrt_ps(a.v)); }
+    RAYTRACER_TARGET friend SimdFloatT min(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm256_min_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT max(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm256_max_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend Mask operator<(SimdFloatT a, SimdFloatT b) { return Mask{_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>(SimdFloatT a, SimdFloatT b) { return Mask{_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>=(SimdFloatT a, SimdFloatT b) { return Mask{_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+    RAYTRACER_TARGET friend SimdFloatT select(Mask mask, SimdFloatT a, SimdFloatT b) {
+        return SimdFloatT(_mm256_blendv_ps(b.v, a.v, mask.m));
+    }
+
+    Native v;
+};
+
+#undef RAYTRACER_TARGET
+#define RAYTRACER_TARGET RAYTRACER_TARGET_AVX512
+
+template<>
+class SimdDoubleT<SimdLevel::Avx512> {
+public:
+    using Native = __m512d;
+    static constexpr int width = 8;
+    // sqrt, min and max go through the masked intrinsics with every lane set, which merge into the operand instead of
+    // an undefined register, so GCC 12 does not warn that one may be used uninitialized
+    static constexpr __mmask8 all_lanes = 0xFF;
+
+    struct Mask {
+        __mmask8 m;
+        [[nodiscard]] unsigned int bits() const { return m; }
+        [[nodiscard]] bool any() const { return m != 0; }
+        friend Mask operator&(Mask a, Mask b) { return Mask{static_cast<__mmask8>(a.m & b.m)}; }
+    };
+
+    SimdDoubleT() = default;
+    RAYTRACER_TARGET explicit SimdDoubleT(Native _v) : v(_v) {}
+    RAYTRACER_TARGET explicit SimdDoubleT(double x) : v(_mm512_set1_pd(x)) {}
+
+    RAYTRACER_TARGET static SimdDoubleT load(const double* p) { return SimdDoubleT(_mm512_loadu_pd(p)); }
+    RAYTRACER_TARGET void store(double* p) const { _mm512_storeu_pd(p, v); }
+
+    RAYTRACER_TARGET friend SimdDoubleT operator+(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm512_add_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT operator-(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm512_sub_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT operator*(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm512_mul_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT operator/(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm512_div_pd(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT sqrt(SimdDoubleT a) { return SimdDoubleT(_mm512_mask_sqrt_pd(a.v, all_lanes, a.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT min(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm512_mask_min_pd(a.v, all_lanes, a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdDoubleT max(SimdDoubleT a, SimdDoubleT b) { return SimdDoubleT(_mm512_mask_max_pd(a.v, all_lanes, a.v, b.v)); }
+    RAYTRACER_TARGET friend Mask operator<(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>=(SimdDoubleT a, SimdDoubleT b) { return Mask{_mm512_cmp_pd_mask(a.v, b.v, _CMP_GE_OQ)}; }
+    RAYTRACER_TARGET friend SimdDoubleT select(Mask mask, SimdDoubleT a, SimdDoubleT b) {
+        return SimdDoubleT(_mm512_mask_blend_pd(mask.m, b.v, a.v));
+    }
+
+    Native v;
+};
+
+template<>
+class SimdFloatT<SimdLevel::Avx512> {
+public:
+    using Native = __m512;
+    static constexpr int width = 16;
+    static constexpr __mmask16 all_lanes = 0xFFFF; // See SimdDoubleT<SimdLevel::Avx512>::all_lanes
+
+    struct Mask {
+        __mmask16 m;
+        [[nodiscard]] unsigned int bits() const { return m; }
+        [[nodiscard]] bool any() const { return m != 0; }
+        friend Mask operator&(Mask a, Mask b) { return Mask{static_cast<__mmask16>(a.m & b.m)}; }
+    };
+
+    SimdFloatT() = default;
+    RAYTRACER_TARGET explicit SimdFloatT(Native _v) : v(_v) {}
+    RAYTRACER_TARGET explicit SimdFloatT(float x) : v(_mm512_set1_ps(x)) {}
+
+    RAYTRACER_TARGET static SimdFloatT load(const float* p) { return SimdFloatT(_mm512_loadu_ps(p)); }
+    RAYTRACER_TARGET void store(float* p) const { _mm512_storeu_ps(p, v); }
+
+    RAYTRACER_TARGET friend SimdFloatT operator+(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm512_add_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT operator-(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm512_sub_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT operator*(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm512_mul_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT operator/(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm512_div_ps(a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT sqrt(SimdFloatT a) { return SimdFloatT(_mm512_mask_sqrt_ps(a.v, all_lanes, a.v)); }
+    RAYTRACER_TARGET friend SimdFloatT min(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm512_mask_min_ps(a.v, all_lanes, a.v, b.v)); }
+    RAYTRACER_TARGET friend SimdFloatT max(SimdFloatT a, SimdFloatT b) { return SimdFloatT(_mm512_mask_max_ps(a.v, all_lanes, a.v, b.v)); }
+    RAYTRACER_TARGET friend Mask operator<(SimdFloatT a, SimdFloatT b) { return Mask{_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>(SimdFloatT a, SimdFloatT b) { return Mask{_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)}; }
+    RAYTRACER_TARGET friend Mask operator>=(SimdFloatT a, SimdFloatT b) { return Mask{_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)}; }
+    RAYTRACER_TARGET friend SimdFloatT select(Mask mask, SimdFloatT a, SimdFloatT b) {
+        return SimdFloatT(_mm512_mask_blend_ps(mask.m, b.v, a.v));
+    }
+
+    Native v;
+};
+
+#undef RAYTRACER_TARGET
+#endif
+
+#endif //RAYTRACER_SIMD_H
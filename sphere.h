@@ -2,43 +2,86 @@
 #define RAYTRACER_SPHERE_H
 
 #include "hittable.h"
+#include "light.h"
+#include "material.h"
+
+// Bound on the error of a hit point on a sphere once it is projected back onto the surface: a few rounding steps on
+// values as large as the center coordinates plus the radius
+inline Real spherePointError(const Point3& center, Real radius) {
+    auto extent = fmax(fmax(fabs(center.x()), fabs(center.y())), fabs(center.z())) + radius;
+    return 8 * std::numeric_limits<Real>::epsilon() * extent;
+}
 
 class Sphere : public Hittable {
 public:
-    Sphere(Point3 _center, double _radius, shared_ptr<Material> _material) : center(_center), radius(_radius), material(std::move(_material)) {}
+    Sphere(Point3 _center, double _radius, MaterialId _material) : center(_center), radius(_radius), material(_material) {
+        auto r_vec = Vec3(radius, radius, radius);
+        bbox = AABB(center - r_vec, center + r_vec);
+        point_error = spherePointError(center, radius);
+    }
 
     bool hit(const Ray &ray, Interval ray_t, HitRecord& rec) const override {
         Vec3 oc = ray.origin() - center; // Origin to center
         auto a = ray.direction().lengthSquared();
         auto half_b = dot(oc, ray.direction());
         auto c = oc.lengthSquared() - radius * radius;
-        auto discriminant = half_b*half_b - a*c;
+
+        // half_b*half_b - a*c cancels badly for spheres that are small next to their distance. By Lagrange's identity
+        // it equals a*r^2 minus the squared cross product of oc and the direction, which only depends on the
+        // distance between the center and the line and keeps its precision (Haines et al., "Precision
+        // Improvements for Ray/Sphere Intersection", Ray Tracing Gems)
+        auto discriminant = a * radius * radius - cross(oc, ray.direction()).lengthSquared();
 
         if (discriminant < 0) return false;
-        auto sqrt_disc = sqrt(discriminant);
+
+        // q adds two terms of the same sign, so neither root below loses precision to cancellation
+        auto q = -(half_b + copysign(sqrt(discriminant), half_b));
+        auto near_root = q / a;
+        auto far_root = c / q;
+        if (near_root > far_root) {
+            std::swap(near_root, far_root);
+        }
 
         // Find the nearest root that lies in the acceptable range
-        auto root = (-half_b - sqrt_disc) / a;
+        auto root = near_root;
         if (!ray_t.surrounds(root)) {
-            root = (-half_b + sqrt_disc) / a;
+            root = far_root;
             if (!ray_t.surrounds(root)) {
                 return false;
             }
         }
 
         rec.t = root;
-        rec.point = ray.at(rec.t);
-        Vec3 outward_normal = (rec.point - center) / radius;
+        rec.object = this;
+        rec.primitive = 0;
+
+        return true;
+    }
+
+    void finalizeHit(const Ray& ray, HitRecord& rec) const override {
+        // Projecting the point back onto the surface removes the error of t
+        Vec3 outward_normal = unitVector(ray.at(rec.t) - center);
+        rec.point = center + radius * outward_normal;
+        rec.point_error = point_error;
         rec.setFaceNormal(ray, outward_normal);
         rec.material = material;
+    }
 
-        return true;
+    void collectLights(const MaterialTable& materials, LightList& lights) const override {
+        auto emission = materials[material].emission();
+        if (!emission.nearZero()) {
+            lights.add(make_shared<SphereLight>(center, radius, emission), this, 0);
+        }
     }
 
+    AABB boundingBox() const override { return bbox; }
+
 private:
     Point3 center;
-    double radius;
-    shared_ptr<Material> material;
+    Real radius;
+    Real point_error;
+    MaterialId material;
+    AABB bbox;
 };
 
 #endif //RAYTRACER_SPHERE_H
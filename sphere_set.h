@@ -0,0 +1,369 @@
+#ifndef RAYTRACER_SPHERE_SET_H
+#define RAYTRACER_SPHERE_SET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "hittable.h"
+#include "simd.h"
+#include "sphere.h"
+#include "wide_bvh.h"
+
+// Group of spheres stored as a structure of arrays and intersected a SIMD register's worth at a time, without a
+// virtual call or heap object per sphere. Small sets are scanned linearly; buildHierarchy() adds a BVH whose leaves
+// are runs of whole SIMD batches, so large sphere fields are traversed in logarithmic time as well. The batch width
+// follows the SIMD level detected when the set is created, and hit() dispatches to the kernel for that level.
+class SphereSet : public Hittable {
+public:
+    SphereSet() : level(simdLevel()), batch_width(simdRealWidth(level)) {}
+
+    // Adding spheres drops the hierarchy, call buildHierarchy() again afterwards
+    void add(const Point3& center, double radius, MaterialId material) {
+        spheres.push_back(SphereRecord{center, Real(radius), spherePointError(center, radius), material});
+
+        auto r_vec = Vec3(radius, radius, radius);
+        bbox = AABB(bbox, AABB(center - r_vec, center + r_vec));
+
+        if (has_hierarchy) {
+            layoutLinear();
+        } else {
+            place(spheres.size() - 1, spheres.size() - 1);
+        }
+    }
+
+    [[nodiscard]] size_t size() const { return spheres.size(); }
+
+    // Builds an SAH hierarchy over the spheres that costs a leaf by its number of SIMD batches
+    void buildHierarchy(unsigned int max_threads = 1) {
+        std::vector<AABB> boxes(spheres.size());
+        for (size_t s = 0; s < spheres.size(); ++s) {
+            auto r_vec = Vec3(spheres[s].radius, spheres[s].radius, spheres[s].radius);
+            boxes[s] = AABB(spheres[s].center - r_vec, spheres[s].center + r_vec);
+        }
+
+        BvhBuilder builder(boxes, max_threads, batch_width, batch_width);
+        spheres = builder.reorder(spheres);
+
+        // Every leaf starts on a new batch, so its spheres are tested with as few batches as possible
+        std::vector<uint32_t> leaf_slots(spheres.size());
+        clearSlots();
+        forEachLeaf(*builder.root, [&](const BvhBuildNode& leaf) {
+            auto first_slot = (slot_count + batch_width - 1) / batch_width * batch_width;
+            leaf_slots[leaf.first_primitive] = static_cast<uint32_t>(first_slot);
+            for (size_t i = 0; i < leaf.primitive_count; ++i) {
+                place(leaf.first_primitive + i, first_slot + i);
+            }
+        });
+
+        hierarchy = WideBvhNodes<hierarchy_width>(*builder.root, [&](size_t first) { return leaf_slots[first]; });
+        has_hierarchy = true;
+    }
+
+    bool hit(const Ray &ray, Interval ray_t, HitRecord& rec) const override {
+        size_t closest = 0;
+        bool hit_anything = dispatchSimd(level, [&](auto tag) {
+            return hitClosest<decltype(tag)::value>(ray, ray_t, closest);
+        });
+
+        if (!hit_anything) {
+            return false;
+        }
+
+        rec.t = ray_t.max;
+        rec.object = this;
+        rec.primitive = static_cast<uint32_t>(closest);
+        return true;
+    }
+
+    bool occluded(const Ray& ray, Interval ray_t) const override {
+        return dispatchSimd(level, [&](auto tag) {
+            constexpr auto Level = decltype(tag)::value;
+            RayConstants<SimdRealT<Level>> rc(ray);
+            size_t any = 0;
+            if (!has_hierarchy) {
+                return intersectSlots<Level, true>(rc, 0, slot_count, ray_t, any);
+            }
+            return hierarchy.template traverse<Level, true>(ray, ray_t,
+                                                            [&](uint32_t first, uint32_t count, Interval& leaf_t) {
+                return intersectSlots<Level, true>(rc, first, count, leaf_t, any);
+            });
+        });
+    }
+
+    uint32_t hitPacket(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const override {
+        size_t closest[max_ray_packet];
+        auto hits = dispatchSimd(level, [&](auto tag) {
+            return hitPacketClosest<decltype(tag)::value>(rays, active, ray_t, closest);
+        });
+        recordHits(hits, ray_t, closest, recs);
+        return hits;
+    }
+
+    uint32_t hitInterleaved(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const override {
+        if (!has_hierarchy) {
+            return hitPacket(rays, active, ray_t, recs); // A linear scan has no fetches worth overlapping
+        }
+
+        size_t closest[max_ray_packet];
+        auto hits = dispatchSimd(level, [&](auto tag) {
+            return hitInterleavedClosest<decltype(tag)::value>(rays, active, ray_t, closest);
+        });
+        recordHits(hits, ray_t, closest, recs);
+        return hits;
+    }
+
+    void finalizeHit(const Ray& ray, HitRecord& rec) const override {
+        const auto& sphere = slot_spheres[rec.primitive];
+        // Projecting the point back onto the surface removes the error of t, see Sphere
+        Vec3 outward_normal = unitVector(ray.at(rec.t) - sphere.center);
+        rec.point = sphere.center + sphere.radius * outward_normal;
+        rec.point_error = sphere.point_error;
+        rec.setFaceNormal(ray, outward_normal);
+        rec.material = sphere.material;
+    }
+
+    // Each emissive sphere is a light, identified by its slot like the hits on it
+    void collectLights(const MaterialTable& materials, LightList& lights) const override {
+        for (size_t slot = 0; slot < slot_count; ++slot) {
+            const auto& sphere = slot_spheres[slot];
+            if (isPadding(slot)) {
+                continue;
+            }
+            auto emission = materials[sphere.material].emission();
+            if (!emission.nearZero()) {
+                lights.add(make_shared<SphereLight>(sphere.center, sphere.radius, emission), this,
+                           static_cast<uint32_t>(slot));
+            }
+        }
+    }
+
+    AABB boundingBox() const override { return bbox; }
+
+private:
+    struct SphereRecord {
+        Point3 center;
+        Real radius;
+        Real point_error;
+        MaterialId material;
+    };
+
+    // Rows of a batch, each holding one field for batch_width slots
+    enum Row { CenterX, CenterY, CenterZ, RadiusSquared, row_count };
+
+    // Per-ray values broadcast once and shared by every batch
+    template<typename SimdReal>
+    struct RayConstants {
+        SimdReal ox, oy, oz, dx, dy, dz, a;
+        Real scalar_a;
+
+        RayConstants() = default;
+
+        explicit RayConstants(const Ray& ray)
+            : ox(ray.origin().x()), oy(ray.origin().y()), oz(ray.origin().z()),
+              dx(ray.direction().x()), dy(ray.direction().y()), dz(ray.direction().z()),
+              a(ray.direction().lengthSquared()), scalar_a(ray.direction().lengthSquared()) {}
+    };
+
+    static constexpr int hierarchy_width = 8;
+
+    SimdLevel level;
+    int batch_width; // Lanes of SimdRealT<level>
+    std::vector<SphereRecord> spheres; // Insertion order, or leaf order once the hierarchy is built
+    AABB bbox;
+
+    // Only what the intersection kernel reads, in batches of rows. Slots that hold no sphere are padding with a
+    // negative squared radius, which no ray can hit.
+    std::vector<Real> lanes;
+    std::vector<SphereRecord> slot_spheres; // Sphere in each slot, read once per hit to fill the record
+    size_t slot_count = 0;
+
+    WideBvhNodes<hierarchy_width> hierarchy;
+    bool has_hierarchy = false;
+
+    template<SimdLevel Level>
+    bool hitClosest(const Ray& ray, Interval& ray_t, size_t& closest) const {
+        RayConstants<SimdRealT<Level>> rc(ray);
+        if (!has_hierarchy) {
+            return intersectSlots<Level>(rc, 0, slot_count, ray_t, closest);
+        }
+        return hierarchy.traverse<Level>(ray, ray_t, [&](uint32_t first, uint32_t count, Interval& leaf_t) {
+            return intersectSlots<Level>(rc, first, count, leaf_t, closest);
+        });
+    }
+
+    // Each leaf reached by the packet tests its batches against every ray that reached it, while they are in cache
+    template<SimdLevel Level>
+    uint32_t hitPacketClosest(const Ray* rays, uint32_t active, Interval* ray_t, size_t* closest) const {
+        RayConstants<SimdRealT<Level>> rc[max_ray_packet];
+        for (auto m = active; m; m &= m - 1) {
+            auto i = __builtin_ctz(m);
+            rc[i] = RayConstants<SimdRealT<Level>>(rays[i]);
+        }
+
+        auto intersectLeaf = [&](uint32_t first, uint32_t count, uint32_t mask, Interval* leaf_t) {
+            uint32_t hits = 0;
+            for (auto m = mask; m; m &= m - 1) {
+                auto i = __builtin_ctz(m);
+                if (intersectSlots<Level>(rc[i], first, count, leaf_t[i], closest[i])) {
+                    hits |= 1u << i;
+                }
+            }
+            return hits;
+        };
+
+        if (!has_hierarchy) {
+            return intersectLeaf(0, static_cast<uint32_t>(slot_count), active, ray_t);
+        }
+        return hierarchy.traversePacket<Level>(rays, active, ray_t, intersectLeaf);
+    }
+
+    template<SimdLevel Level>
+    uint32_t hitInterleavedClosest(const Ray* rays, uint32_t active, Interval* ray_t, size_t* closest) const {
+        RayConstants<SimdRealT<Level>> rc[max_ray_packet];
+        for (auto m = active; m; m &= m - 1) {
+            auto i = __builtin_ctz(m);
+            rc[i] = RayConstants<SimdRealT<Level>>(rays[i]);
+        }
+
+        return hierarchy.traverseInterleaved<Level>(rays, active, ray_t,
+                                                    [&](int i, uint32_t first, uint32_t count, Interval& leaf_t) {
+            return intersectSlots<Level>(rc[i], first, count, leaf_t, closest[i]);
+        }, [&](uint32_t first, uint32_t count) {
+            prefetchLines(&lanes[first * row_count], count * row_count * sizeof(Real));
+        });
+    }
+
+    void recordHits(uint32_t hits, const Interval* ray_t, const size_t* closest, HitRecord* recs) const {
+        for (auto m = hits; m; m &= m - 1) {
+            auto i = __builtin_ctz(m);
+            recs[i].t = ray_t[i].max;
+            recs[i].object = this;
+            recs[i].primitive = static_cast<uint32_t>(closest[i]);
+        }
+    }
+
+    // Tests the slots [first, first + count), starting on a batch boundary, and lowers ray_t.max to the closest hit.
+    // With AnyHit it returns at the first batch with a hit instead, leaving ray_t and closest alone.
+    template<SimdLevel Level, bool AnyHit = false>
+    bool intersectSlots(const RayConstants<SimdRealT<Level>>& rc, size_t first, size_t count, Interval& ray_t,
+                        size_t& closest) const {
+        using SimdReal = SimdRealT<Level>;
+        SimdReal zero(0), no_hit(infinity);
+
+        // Roots are compared scaled by `a`, so t itself is only divided out once per call, for the closest hit
+        SimdReal scaled_t_min(ray_t.min * rc.scalar_a);
+        Real closest_scaled = ray_t.max * rc.scalar_a;
+        Real roots[SimdReal::width];
+        bool hit_anything = false;
+
+        for (size_t i = first; i < first + count; i += SimdReal::width) {
+            const Real* batch = &lanes[i * row_count];
+            if (traversal_counters.enabled) {
+                traversal_counters.touch(batch, SimdReal::width * row_count * sizeof(Real));
+            }
+            auto ocx = rc.ox - SimdReal::load(batch + CenterX * SimdReal::width);
+            auto ocy = rc.oy - SimdReal::load(batch + CenterY * SimdReal::width);
+            auto ocz = rc.oz - SimdReal::load(batch + CenterZ * SimdReal::width);
+            auto radius_squared = SimdReal::load(batch + RadiusSquared * SimdReal::width);
+
+            // Same numerically careful discriminant and roots as Sphere::hit
+            auto half_b = ocx*rc.dx + ocy*rc.dy + ocz*rc.dz;
+            auto cx = ocy*rc.dz - ocz*rc.dy;
+            auto cy = ocz*rc.dx - ocx*rc.dz;
+            auto cz = ocx*rc.dy - ocy*rc.dx;
+            auto discriminant = rc.a*radius_squared - (cx*cx + cy*cy + cz*cz);
+
+            auto real_roots = discriminant >= zero;
+            if (!real_roots.any()) {
+                continue;
+            }
+
+            // Nearest root inside the acceptable range, or infinity where neither root is
+            auto sqrt_disc = sqrt(max(discriminant, zero));
+            auto q = zero - (half_b + select(half_b < zero, zero - sqrt_disc, sqrt_disc));
+            auto c = (ocx*ocx + ocy*ocy + ocz*ocz) - radius_squared;
+            auto c_root = rc.a * c / q;
+            auto near_root = min(q, c_root);
+            auto far_root = max(q, c_root);
+            auto scaled_t_max = SimdReal(closest_scaled);
+            auto root = select(real_roots & (far_root > scaled_t_min) & (far_root < scaled_t_max), far_root, no_hit);
+            root = select(real_roots & (near_root > scaled_t_min) & (near_root < scaled_t_max), near_root, root);
+
+            auto hit_lanes = (root < scaled_t_max).bits();
+            if (!hit_lanes) {
+                continue;
+            }
+            if constexpr (AnyHit) {
+                return true;
+            }
+
+            root.store(roots);
+            while (hit_lanes) {
+                int lane = __builtin_ctz(hit_lanes);
+                hit_lanes &= hit_lanes - 1;
+                if (roots[lane] < closest_scaled) {
+                    closest_scaled = roots[lane];
+                    closest = i + lane;
+                    hit_anything = true;
+                }
+            }
+        }
+
+        if (hit_anything) {
+            ray_t.max = closest_scaled / rc.scalar_a;
+        }
+        return hit_anything;
+    }
+
+    void clearSlots() {
+        lanes.clear();
+        slot_spheres.clear();
+        slot_count = 0;
+    }
+
+    [[nodiscard]] bool isPadding(size_t slot) const {
+        return lanes[slot / batch_width * batch_width * row_count + RadiusSquared * batch_width + slot % batch_width] < 0;
+    }
+
+    // Writes spheres[s] into the given slot, adding padded batches as needed
+    void place(size_t s, size_t slot) {
+        while (slot >= slot_spheres.size()) {
+            auto batch = lanes.size();
+            lanes.resize(batch + batch_width * row_count, 0);
+            std::fill_n(lanes.begin() + batch + RadiusSquared * batch_width, batch_width, -infinity);
+            slot_spheres.resize(slot_spheres.size() + batch_width);
+        }
+
+        const auto& sphere = spheres[s];
+        Real* batch = &lanes[slot / batch_width * batch_width * row_count];
+        auto lane = slot % batch_width;
+        batch[CenterX * batch_width + lane] = sphere.center.x();
+        batch[CenterY * batch_width + lane] = sphere.center.y();
+        batch[CenterZ * batch_width + lane] = sphere.center.z();
+        batch[RadiusSquared * batch_width + lane] = sphere.radius * sphere.radius;
+        slot_spheres[slot] = sphere;
+        slot_count = std::max(slot_count, slot + 1);
+    }
+
+    void layoutLinear() {
+        has_hierarchy = false;
+        hierarchy = WideBvhNodes<hierarchy_width>();
+        clearSlots();
+        for (size_t s = 0; s < spheres.size(); ++s) {
+            place(s, s);
+        }
+    }
+
+    template<typename Fn>
+    static void forEachLeaf(const BvhBuildNode& node, Fn&& fn) {
+        if (!node.isLeaf()) {
+            forEachLeaf(*node.children[0], fn);
+            forEachLeaf(*node.children[1], fn);
+        } else if (node.primitive_count > 0) {
+            fn(node);
+        }
+    }
+};
+
+#endif //RAYTRACER_SPHERE_SET_H
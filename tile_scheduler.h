@@ -0,0 +1,118 @@
+#ifndef RAYTRACER_TILE_SCHEDULER_H
+#define RAYTRACER_TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Rectangle of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Splits an image into square tiles and hands them out to worker threads. Every thread starts with a contiguous run
+// of tiles in its own deque and takes from the front of it; a thread whose deque is empty steals from the back of
+// the fullest other deque, so no thread sits idle while tiles remain anywhere.
+class TileScheduler {
+public:
+    TileScheduler(int image_width, int image_height, int tile_size, unsigned int n_threads) : queues(n_threads) {
+        tile_size = std::max(tile_size, 1);
+        std::vector<Tile> tiles;
+        for (int y = 0; y < image_height; y += tile_size) {
+            for (int x = 0; x < image_width; x += tile_size) {
+                tiles.push_back(Tile{x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height)});
+            }
+        }
+        tile_count = tiles.size();
+
+        for (unsigned int t = 0; t < n_threads; ++t) {
+            queues[t] = std::make_unique<Queue>();
+            auto begin = tiles.begin() + tile_count * t / n_threads;
+            auto end = tiles.begin() + tile_count * (t + 1) / n_threads;
+            queues[t]->tiles.assign(begin, end);
+        }
+    }
+
+    [[nodiscard]] size_t tileCount() const { return tile_count; }
+
+    // Gets the next tile for the given thread, returning false once every tile has been handed out
+    bool next(unsigned int thread, Tile& tile) {
+        {
+            auto& own = *queues[thread];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tiles.empty()) {
+                tile = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+
+        // Tiles are never added, so once every deque has been seen empty there is nothing left to steal
+        while (true) {
+            Queue* victim = nullptr;
+            size_t victim_size = 0;
+            for (auto& queue : queues) {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                if (queue->tiles.size() > victim_size) {
+                    victim = queue.get();
+                    victim_size = queue->tiles.size();
+                }
+            }
+            if (!victim) {
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(victim->mutex);
+            if (!victim->tiles.empty()) {
+                tile = victim->tiles.back();
+                victim->tiles.pop_back();
+                return true;
+            }
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    size_t tile_count = 0;
+};
+
+// Holds worker threads at the end of a stage until all of them have reached it, for work split in stages where each
+// reads what the previous one wrote. The last thread to arrive runs a completion step, such as resetting the work
+// counter of the next stage, before any of them goes on.
+class StageBarrier {
+public:
+    explicit StageBarrier(unsigned int _n_threads) : n_threads(_n_threads) {}
+
+    template<typename CompletionFn>
+    void arriveAndWait(CompletionFn&& completion) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto arrival_generation = generation;
+        if (++arrived == n_threads) {
+            completion();
+            arrived = 0;
+            ++generation;
+            lock.unlock();
+            released.notify_all();
+            return;
+        }
+        released.wait(lock, [&] { return generation != arrival_generation; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable released;
+    unsigned int n_threads;
+    unsigned int arrived = 0;
+    uint64_t generation = 0; // Counts completed stages, so that a thread is not released by a stale wake-up
+};
+
+#endif //RAYTRACER_TILE_SCHEDULER_H
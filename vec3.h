@@ -5,22 +5,30 @@
 #include <iostream>
 #include "mathutils.h"
 
-class Vec3 {
+// Three component vector of scalar type T. The renderer works in Vec3, which uses the build's Real type.
+template<typename T>
+class Vec3T {
 public:
-    double e[3];
+    using Scalar = T;
 
-    Vec3() : e{0, 0, 0} {}
-    Vec3(double x, double y, double z) : e{x, y, z} {}
+    T e[3];
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    Vec3T() : e{0, 0, 0} {}
+    Vec3T(T x, T y, T z) : e{x, y, z} {}
 
-    Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    // Conversion between precisions, for values that cross between Real math and double precision accumulators
+    template<typename U>
+    explicit Vec3T(const Vec3T<U>& v) : e{static_cast<T>(v.e[0]), static_cast<T>(v.e[1]), static_cast<T>(v.e[2])} {}
 
-    Vec3& operator+=(const Vec3 &v) {
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+
+    Vec3T operator-() const { return Vec3T(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
+
+    Vec3T& operator+=(const Vec3T &v) {
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
@@ -28,7 +36,7 @@ public:
         return *this;
     }
 
-    Vec3& operator*=(const double t) {
+    Vec3T& operator*=(const T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
@@ -36,116 +44,170 @@ public:
         return *this;
     }
 
-    Vec3& operator/=(const double t) {
+    Vec3T& operator/=(const T t) {
         return *this *= 1/t;
     }
 
-    [[nodiscard]] double lengthSquared() const {
+    [[nodiscard]] T lengthSquared() const {
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
 
-    [[nodiscard]] double length() const {
+    [[nodiscard]] T length() const {
         return sqrt(lengthSquared());
     }
 
     bool nearZero() const {
-        auto s = 1e-8;
+        auto s = T(1e-8);
         return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
     }
 
-    static Vec3 random() {
-        return {randomDouble(), randomDouble(), randomDouble()};
+    // Braced initialization draws the components in order, so scenes are the same with every compiler
+    static Vec3T random(Rng& rng = threadRng()) {
+        return {T(randomDouble(rng)), T(randomDouble(rng)), T(randomDouble(rng))};
     }
 
-    static Vec3 random(double min, double max) {
-        return {randomDouble(min, max), randomDouble(min, max), randomDouble(min, max)};
+    static Vec3T random(double min, double max, Rng& rng = threadRng()) {
+        return {T(randomDouble(min, max, rng)), T(randomDouble(min, max, rng)), T(randomDouble(min, max, rng))};
     }
 };
 
+using Vec3 = Vec3T<Real>;
 using Point3 = Vec3; // 3D point
 
-// Vector Util Functions
-inline std::ostream& operator<<(std::ostream &out, const Vec3 &v) {
+// Vector Util Functions. Scalar arguments take the vector's own type, so literals and other precisions convert to it.
+template<typename T>
+inline std::ostream& operator<<(std::ostream &out, const Vec3T<T> &v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline Vec3 operator+(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template<typename T>
+inline Vec3T<T> operator+(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline Vec3 operator-(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template<typename T>
+inline Vec3T<T> operator-(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline Vec3 operator*(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template<typename T>
+inline Vec3T<T> operator*(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline Vec3 operator*(double t, const Vec3 &v) {
-    return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template<typename T>
+inline Vec3T<T> operator*(typename Vec3T<T>::Scalar t, const Vec3T<T> &v) {
+    return Vec3T<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline Vec3 operator*(const Vec3 &v, double t) {
+template<typename T>
+inline Vec3T<T> operator*(const Vec3T<T> &v, typename Vec3T<T>::Scalar t) {
     return t * v;
 }
 
-inline Vec3 operator/(const Vec3 &v, double t) {
+template<typename T>
+inline Vec3T<T> operator/(const Vec3T<T> &v, typename Vec3T<T>::Scalar t) {
     return (1/t) * v;
 }
 
-inline double dot(const Vec3 &u, const Vec3 &v) {
+template<typename T>
+inline T dot(const Vec3T<T> &u, const Vec3T<T> &v) {
     return u.e[0]*v.e[0]
          + u.e[1]*v.e[1]
          + u.e[2]*v.e[2];
 }
 
-inline Vec3 cross(const Vec3 &u, const Vec3 &v) {
-    return Vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2]*v.e[0] - u.e[0]*v.e[2],
-                u.e[0]*v.e[1] - u.e[1]*v.e[0]);
+template<typename T>
+inline Vec3T<T> cross(const Vec3T<T> &u, const Vec3T<T> &v) {
+    return Vec3T<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                    u.e[2]*v.e[0] - u.e[0]*v.e[2],
+                    u.e[0]*v.e[1] - u.e[1]*v.e[0]);
 }
 
-inline Vec3 unitVector(Vec3 v) {
+template<typename T>
+inline Vec3T<T> unitVector(Vec3T<T> v) {
     return v / v.length();
 }
 
-inline Vec3 randomInUnitDisk() {
-    while (true) {
-        auto p = Vec3(randomDouble(-1, 1), randomDouble(-1, 1), 0);
-        if (p.lengthSquared() < 1)
-            return p;
-    }
+// The samplers below map uniform numbers in [0, 1) in closed form, without rejection loops or data dependent
+// branches, so stratified inputs give stratified outputs and every call costs the same
+
+// Uniformly distributed point on the unit sphere
+inline Vec3 sampleUnitSphere(Real u1, Real u2) {
+    auto z = 1 - 2*u1;
+    auto r = sqrt(fmax(Real(0), 1 - z*z));
+    auto phi = Real(2*pi)*u2;
+    return Vec3(r*cos(phi), r*sin(phi), z);
 }
 
-inline Vec3 randomInUnitSphere() {
-    while (true) {
-        auto p = Vec3::random(-1, 1);
-        if (p.lengthSquared() < 1)
-            return p;
-    }
+// Uniformly distributed point inside the unit ball
+inline Vec3 sampleUnitBall(Real u1, Real u2, Real u3) {
+    return cbrt(u3) * sampleUnitSphere(u1, u2);
 }
 
-inline Vec3 randomUnitVector() {
-    return unitVector(randomInUnitSphere());
+// Sine and cosine of an angle in [-pi/4, pi/4] from their Taylor series, accurate to about 1e-11 on that range
+template<typename T>
+inline void sinCosQuarter(T x, T& sin_x, T& cos_x) {
+    auto x2 = x*x;
+    sin_x = x * (1 + x2*(T(-1.0/6) + x2*(T(1.0/120) + x2*(T(-1.0/5040) + x2*(T(1.0/362880) - x2*T(1.0/39916800))))));
+    cos_x = 1 + x2*(T(-1.0/2) + x2*(T(1.0/24) + x2*(T(-1.0/720) + x2*(T(1.0/40320) + x2*(T(-1.0/3628800)
+                                                                                  + x2*T(1.0/479001600))))));
 }
 
-inline Vec3 randomOnHemisphere(const Vec3& normal) {
-    Vec3 onUnitSphere = randomUnitVector();
-    if (dot(onUnitSphere, normal) > 0.0) {
-        return onUnitSphere; // In the same hemisphere as the normal
-    } else {
-        return -onUnitSphere;
-    }
+// Uniformly distributed point inside the unit disk in the xy plane, using Shirley and Chiu's concentric mapping of
+// the square, which keeps neighbouring samples close together. Both halves of the mapping only need the angle
+// (pi/4) * ratio, so its sine and cosine come from sinCosQuarter() and are swapped for the vertical half.
+inline Vec3 sampleUnitDisk(Real u1, Real u2) {
+    auto a = 2*u1 - 1;
+    auto b = 2*u2 - 1;
+    bool horizontal = a*a > b*b;
+    auto r = horizontal ? a : b;
+    auto ratio = horizontal ? b / a : a / (b != 0 ? b : 1);
+    Real sin_theta, cos_theta;
+    sinCosQuarter(Real(pi/4) * ratio, sin_theta, cos_theta);
+    return horizontal ? Vec3(r*cos_theta, r*sin_theta, 0) : Vec3(r*sin_theta, r*cos_theta, 0);
+}
+
+// Two unit vectors that form an orthonormal basis with the unit vector `normal`, without branches (Duff et al.,
+// "Building an Orthonormal Basis, Revisited")
+inline void orthonormalBasis(const Vec3& normal, Vec3& tangent, Vec3& bitangent) {
+    auto sign = copysign(Real(1), normal.z());
+    auto a = -1 / (sign + normal.z());
+    auto b = normal.x() * normal.y() * a;
+    tangent = Vec3(1 + sign * normal.x() * normal.x() * a, sign * b, -sign * normal.x());
+    bitangent = Vec3(b, sign + normal.y() * normal.y() * a, -normal.y());
+}
+
+// Unit direction in the hemisphere around the unit vector `normal`, with density proportional to the cosine to it
+inline Vec3 sampleCosineHemisphere(const Vec3& normal, Real u1, Real u2) {
+    auto d = sampleUnitDisk(u1, u2);
+    auto z = sqrt(fmax(Real(0), 1 - d.x()*d.x() - d.y()*d.y()));
+
+    Vec3 tangent, bitangent;
+    orthonormalBasis(normal, tangent, bitangent);
+    return d.x()*tangent + d.y()*bitangent + z*normal;
+}
+
+// Unit direction uniformly distributed in the cone of directions whose cosine to the unit vector `axis` is at least
+// 1 - one_minus_cos_max. The density is 1 / (2 pi one_minus_cos_max) per unit solid angle.
+inline Vec3 sampleCone(const Vec3& axis, Real one_minus_cos_max, Real u1, Real u2) {
+    auto cos_theta = 1 - u1 * one_minus_cos_max;
+    auto sin_theta = sqrt(fmax(Real(0), 1 - cos_theta*cos_theta));
+    auto phi = 2 * Real(pi) * u2;
+
+    Vec3 tangent, bitangent;
+    orthonormalBasis(axis, tangent, bitangent);
+    return sin_theta*cos(phi)*tangent + sin_theta*sin(phi)*bitangent + cos_theta*axis;
 }
 
 inline Vec3 reflect(const Vec3& v, const Vec3& n) {
     return v - 2*dot(v, n)*n;
 }
 
-inline Vec3 refract(const Vec3& uv, const Vec3& n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+inline Vec3 refract(const Vec3& uv, const Vec3& n, Real etai_over_etat) {
+    auto cos_theta = fmin(dot(-uv, n), Real(1));
     Vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
-    Vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.lengthSquared())) * n;
+    Vec3 r_out_parallel = -sqrt(fabs(1 - r_out_perp.lengthSquared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
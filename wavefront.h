@@ -0,0 +1,163 @@
+#ifndef RAYTRACER_WAVEFRONT_H
+#define RAYTRACER_WAVEFRONT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "color.h"
+#include "hittable.h"
+
+// Storage for the wavefront integrator (see Camera), which moves a large batch of paths through one stage at a time
+// instead of following each path to its end
+
+// Fills order with the indices of keys sorted by key, keeping equal keys in their original order. Keys must be
+// below key_count.
+inline void countingSort(const std::vector<uint32_t>& keys, size_t key_count, std::vector<uint32_t>& order) {
+    std::vector<uint32_t> starts(key_count + 1, 0);
+    for (auto key : keys) {
+        ++starts[key + 1];
+    }
+    for (size_t k = 0; k < key_count; ++k) {
+        starts[k + 1] += starts[k];
+    }
+
+    order.resize(keys.size());
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+        order[starts[keys[i]]++] = i;
+    }
+}
+
+// Paths waiting to be intersected, stored as a structure of arrays
+class PathQueue {
+public:
+    std::vector<uint32_t> path; // Index of each entry's path in its wave
+
+    [[nodiscard]] size_t size() const { return path.size(); }
+
+    void clear() {
+        path.clear();
+        for (auto* field : {&origin_x, &origin_y, &origin_z, &direction_x, &direction_y, &direction_z,
+                            &throughput_r, &throughput_g, &throughput_b, &scatter_pdf, &from_x, &from_y, &from_z}) {
+            field->clear();
+        }
+    }
+
+    // pdf is the density with which the ray's direction was scattered from the hit point `from`, see
+    // Camera::emitted()
+    void push(uint32_t path_index, const Ray& ray, const Color& throughput, Real pdf, const Point3& from) {
+        path.push_back(path_index);
+        origin_x.push_back(ray.origin().x());
+        origin_y.push_back(ray.origin().y());
+        origin_z.push_back(ray.origin().z());
+        direction_x.push_back(ray.direction().x());
+        direction_y.push_back(ray.direction().y());
+        direction_z.push_back(ray.direction().z());
+        throughput_r.push_back(throughput.x());
+        throughput_g.push_back(throughput.y());
+        throughput_b.push_back(throughput.z());
+        scatter_pdf.push_back(pdf);
+        from_x.push_back(from.x());
+        from_y.push_back(from.y());
+        from_z.push_back(from.z());
+    }
+
+    [[nodiscard]] Ray ray(size_t i) const {
+        return Ray(Point3(origin_x[i], origin_y[i], origin_z[i]), Vec3(direction_x[i], direction_y[i], direction_z[i]));
+    }
+
+    [[nodiscard]] Color throughput(size_t i) const {
+        return Color(throughput_r[i], throughput_g[i], throughput_b[i]);
+    }
+
+    [[nodiscard]] Real scatterPdf(size_t i) const { return scatter_pdf[i]; }
+
+    [[nodiscard]] Point3 scatterPoint(size_t i) const { return Point3(from_x[i], from_y[i], from_z[i]); }
+
+    // Order in which to trace the entries so that rays leaving the same region in similar directions follow each
+    // other: along a Morton curve through the cells of a grid over the bounds of the queued origins, and by direction
+    // octant within a cell. The grid gets finer with the size of the queue, up to 16 cells per axis, so that there are
+    // about as many bins as rays. keys is scratch space.
+    void binnedOrder(std::vector<uint32_t>& keys, std::vector<uint32_t>& order) const {
+        uint32_t grid_bits = 1; // Per axis
+        while (grid_bits < 4 && size_t(1) << (3*grid_bits + 6) <= size()) {
+            ++grid_bits;
+        }
+        uint32_t grid_cells = 1 << grid_bits;
+
+        const std::vector<Real>* origins[3] = {&origin_x, &origin_y, &origin_z};
+        Real low[3], scale[3];
+        for (int a = 0; a < 3; ++a) {
+            auto [min, max] = std::minmax_element(origins[a]->begin(), origins[a]->end());
+            low[a] = size() > 0 ? *min : 0;
+            scale[a] = size() > 0 && *max > *min ? grid_cells / (*max - *min) : 0;
+        }
+
+        keys.resize(size());
+        for (size_t i = 0; i < size(); ++i) {
+            uint32_t key = static_cast<uint32_t>(direction_x[i] < 0)
+                         | static_cast<uint32_t>(direction_y[i] < 0) << 1
+                         | static_cast<uint32_t>(direction_z[i] < 0) << 2;
+            for (int a = 0; a < 3; ++a) {
+                auto cell = std::min(static_cast<uint32_t>(((*origins[a])[i] - low[a]) * scale[a]), grid_cells - 1);
+                for (uint32_t bit = 0; bit < grid_bits; ++bit) {
+                    key |= ((cell >> bit) & 1) << (3*bit + a + 3);
+                }
+            }
+            keys[i] = key;
+        }
+        countingSort(keys, size_t(1) << (3*grid_bits + 3), order);
+    }
+
+private:
+    std::vector<Real> origin_x, origin_y, origin_z;
+    std::vector<Real> direction_x, direction_y, direction_z;
+    std::vector<Real> throughput_r, throughput_g, throughput_b;
+    std::vector<Real> scatter_pdf;
+    std::vector<Real> from_x, from_y, from_z; // Hit point each ray was scattered from, unlike its offset origin
+};
+
+// Closest hits of one bounce, waiting to be shaded
+struct HitQueue {
+    std::vector<uint32_t> entry; // Index of the hit's ray in the PathQueue that was intersected
+    std::vector<HitRecord> records;
+
+    [[nodiscard]] size_t size() const { return entry.size(); }
+
+    void clear() {
+        entry.clear();
+        records.clear();
+    }
+
+    void push(uint32_t queue_entry, const HitRecord& record) {
+        entry.push_back(queue_entry);
+        records.push_back(record);
+    }
+};
+
+// Shadow rays of one bounce towards the points light sampling picked, waiting to be traced. Each carries the light
+// its path receives if nothing blocks it.
+struct ShadowQueue {
+    std::vector<uint32_t> path;
+    std::vector<Ray> rays;
+    std::vector<Real> t_max; // Up to which the ray must be unblocked
+    std::vector<Color> contribution;
+
+    [[nodiscard]] size_t size() const { return path.size(); }
+
+    void clear() {
+        path.clear();
+        rays.clear();
+        t_max.clear();
+        contribution.clear();
+    }
+
+    void push(uint32_t path_index, const Ray& ray, Real ray_t_max, const Color& light) {
+        path.push_back(path_index);
+        rays.push_back(ray);
+        t_max.push_back(ray_t_max);
+        contribution.push_back(light);
+    }
+};
+
+#endif //RAYTRACER_WAVEFRONT_H
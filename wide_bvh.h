@@ -0,0 +1,576 @@
+#ifndef RAYTRACER_WIDE_BVH_H
+#define RAYTRACER_WIDE_BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+#include "simd.h"
+
+// Hierarchy with Width (4 or 8) children per node, collapsed from the binary BvhBuilder tree. Child boxes are
+// stored in single precision as a structure of arrays so one SIMD sequence tests a ray against every child of a
+// node, and the children that are hit are visited nearest first. Leaves are handed back to the owner through a
+// callback, like LinearBvh. Traversal is templated on the SIMD level, so owners run it inside their dispatchSimd().
+template<int Width>
+class WideBvhNodes {
+    static_assert(Width == 4 || Width == 8, "WideBvhNodes supports 4 or 8 children per node");
+
+public:
+    WideBvhNodes() {}
+
+    explicit WideBvhNodes(const BvhBuildNode& root) : WideBvhNodes(root, [](size_t first) { return first; }) {}
+
+    // leaf_offset maps the first primitive of each build leaf to the offset stored in the node
+    template<typename LeafOffset>
+    WideBvhNodes(const BvhBuildNode& root, LeafOffset&& leaf_offset) {
+        padding = floatBoxPadding(root.bbox);
+        nodes.emplace_back();
+        collapse(root, 0, 1, leaf_offset);
+    }
+
+    [[nodiscard]] size_t nodeCount() const { return nodes.size(); }
+
+    [[nodiscard]] size_t leafCount() const { return leaf_count; }
+
+    [[nodiscard]] size_t memoryBytes() const { return nodes.size() * sizeof(Node); }
+
+    // Calls leaf(offset, count, ray_t) for every leaf the ray reaches, nearest first. The callback returns whether
+    // it found a hit and must then lower ray_t.max to it, which culls the remaining farther entries. With AnyHit the
+    // traversal stops at the first leaf with a hit instead, and visits children in node order, since any hit will do.
+    template<SimdLevel Level, bool AnyHit = false, typename LeafFn>
+    bool traverse(const Ray& ray, Interval& ray_t, LeafFn&& leaf) const {
+        if (nodes.empty()) {
+            return false;
+        }
+
+        RayData rd(ray);
+
+        StackEntry stack[stack_size];
+        int sp = 0;
+        stack[sp++] = StackEntry{0, 0, static_cast<float>(ray_t.min)};
+
+        bool hit_anything = false;
+        float t_near[Width];
+
+        while (sp > 0) {
+            auto entry = stack[--sp];
+            if (entry.t > ray_t.max) {
+                continue; // A closer hit was found since this entry was pushed
+            }
+
+            if (entry.count > 0) {
+                bool leaf_hit = leaf(static_cast<uint32_t>(entry.child), entry.count, ray_t);
+                if (AnyHit && leaf_hit) {
+                    return true;
+                }
+                hit_anything |= leaf_hit;
+                continue;
+            }
+
+            const auto& node = nodes[entry.child];
+            if (traversal_counters.enabled) {
+                traversal_counters.touch(&node, sizeof(Node));
+            }
+            auto mask = intersectChildren<Level>(node, rd, static_cast<float>(ray_t.min),
+                                                 static_cast<float>(ray_t.max) * far_scale, t_near);
+
+            if constexpr (AnyHit) {
+                for (; mask; mask &= mask - 1) {
+                    int c = __builtin_ctz(mask);
+                    stack[sp++] = StackEntry{node.child[c], node.count[c], t_near[c]};
+                }
+            } else {
+                pushChildren(node, mask, t_near, stack, sp);
+            }
+        }
+
+        return hit_anything;
+    }
+
+    // Version of traverse() for the rays whose bits are set in `active` that need not be coherent, such as scattered
+    // rays. Each ray keeps its own stack and the rays take turns: once a ray has visited a node or leaf, the entry it
+    // will visit next is prefetched and the next ray runs, so the memory fetches of all the rays overlap instead of
+    // stalling one ray at a time. leaf(i, offset, count, ray_t[i]) works as in traverse() for ray i, and
+    // prefetch_leaf(offset, count) starts loading the primitives of a leaf. Returns the mask of rays that hit.
+    template<SimdLevel Level, typename LeafFn, typename PrefetchLeafFn>
+    uint32_t traverseInterleaved(const Ray* rays, uint32_t active, Interval* ray_t, LeafFn&& leaf,
+                                 PrefetchLeafFn&& prefetch_leaf) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+
+        // Each ray's stack holds at most Width - 1 waiting siblings per level of this tree, plus the root
+        auto stride = static_cast<size_t>(depth) * (Width - 1) + 1;
+        auto& scratch = interleavedStacks();
+        if (scratch.levels.size() <= scratch.level) {
+            scratch.levels.emplace_back();
+        }
+        auto& block = scratch.levels[scratch.level++];
+        if (block.size() < max_ray_packet * stride) {
+            block.resize(max_ray_packet * stride);
+        }
+        StackEntry* stacks = block.data(); // Stays valid if a nested traversal adds a level, as moves keep the buffer
+
+        RayData rd[max_ray_packet];
+        int sp[max_ray_packet];
+        for (auto m = active; m; m &= m - 1) {
+            auto i = __builtin_ctz(m);
+            rd[i] = RayData(rays[i]);
+            stacks[i * stride] = StackEntry{0, 0, static_cast<float>(ray_t[i].min)};
+            sp[i] = 1;
+        }
+
+        uint32_t hits = 0;
+        float t_near[Width];
+
+        for (auto in_flight = active; in_flight;) {
+            for (auto m = in_flight; m; m &= m - 1) {
+                auto i = __builtin_ctz(m);
+                auto* stack = stacks + i * stride;
+
+                // Entries culled by a closer hit cost no fetch, so they are skipped without giving up the turn
+                StackEntry entry;
+                bool visit = false;
+                while (sp[i] > 0 && !visit) {
+                    entry = stack[--sp[i]];
+                    visit = !(entry.t > ray_t[i].max);
+                }
+
+                if (visit && entry.count > 0) {
+                    if (leaf(i, static_cast<uint32_t>(entry.child), entry.count, ray_t[i])) {
+                        hits |= 1u << i;
+                    }
+                } else if (visit) {
+                    const auto& node = nodes[entry.child];
+                    if (traversal_counters.enabled) {
+                        traversal_counters.touch(&node, sizeof(Node));
+                    }
+                    auto mask = intersectChildren<Level>(node, rd[i], static_cast<float>(ray_t[i].min),
+                                                         static_cast<float>(ray_t[i].max) * far_scale, t_near);
+                    pushChildren(node, mask, t_near, stack, sp[i]);
+                }
+
+                if (sp[i] == 0) {
+                    in_flight &= ~(1u << i);
+                    continue;
+                }
+                const auto& next = stack[sp[i] - 1];
+                if (next.count > 0) {
+                    prefetch_leaf(static_cast<uint32_t>(next.child), next.count);
+                } else {
+                    prefetchLines(&nodes[next.child], sizeof(Node));
+                }
+            }
+        }
+
+        --scratch.level;
+        return hits;
+    }
+
+    // Packet version of traverse() for the rays whose bits are set in `active`. Each node is fetched once for the
+    // packet and tested against every ray still active, and a child is visited with the mask of the rays that hit
+    // it. leaf(offset, count, mask, ray_t) returns the mask of rays that found a hit and lowers their ray_t[i].max,
+    // which drops them from farther entries. Returns the mask of rays that hit anything.
+    template<SimdLevel Level, typename LeafFn>
+    uint32_t traversePacket(const Ray* rays, uint32_t active, Interval* ray_t, LeafFn&& leaf) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+
+        RayData rd[max_ray_packet];
+        for (auto m = active; m; m &= m - 1) {
+            auto i = __builtin_ctz(m);
+            rd[i] = RayData(rays[i]);
+        }
+
+        PacketEntry stack[stack_size];
+        int sp = 0;
+        stack[sp++] = PacketEntry{0, 0, active, -HUGE_VALF};
+
+        uint32_t hits = 0;
+        float t_near[Width];
+
+        while (sp > 0) {
+            auto entry = stack[--sp];
+
+            // Rays with a hit closer than every entry distance of the packet are done with this entry
+            auto mask = entry.mask;
+            for (auto m = entry.mask; m; m &= m - 1) {
+                auto i = __builtin_ctz(m);
+                if (entry.t > ray_t[i].max) {
+                    mask &= ~(1u << i);
+                }
+            }
+            if (!mask) {
+                continue;
+            }
+
+            if (entry.count > 0) {
+                hits |= leaf(static_cast<uint32_t>(entry.child), entry.count, mask, ray_t);
+                continue;
+            }
+
+            const auto& node = nodes[entry.child];
+            if (traversal_counters.enabled) {
+                traversal_counters.touch(&node, sizeof(Node));
+            }
+            uint32_t child_mask[Width] = {};
+            float child_t[Width];
+            std::fill_n(child_t, Width, static_cast<float>(infinity));
+            for (auto m = mask; m; m &= m - 1) {
+                auto i = __builtin_ctz(m);
+                auto hit_children = intersectChildren<Level>(node, rd[i], static_cast<float>(ray_t[i].min),
+                                                             static_cast<float>(ray_t[i].max) * far_scale, t_near);
+                while (hit_children) {
+                    int c = __builtin_ctz(hit_children);
+                    hit_children &= hit_children - 1;
+                    child_mask[c] |= 1u << i;
+                    child_t[c] = std::min(child_t[c], t_near[c]);
+                }
+            }
+
+            // Farthest first, by the nearest entry of any ray, like traverse()
+            int first = sp;
+            for (int c = 0; c < Width; ++c) {
+                if (!child_mask[c]) {
+                    continue;
+                }
+
+                PacketEntry child_entry{node.child[c], node.count[c], child_mask[c], child_t[c]};
+                int k = sp++;
+                while (k > first && stack[k - 1].t < child_entry.t) {
+                    stack[k] = stack[k - 1];
+                    --k;
+                }
+                stack[k] = child_entry;
+            }
+        }
+
+        return hits;
+    }
+
+private:
+    struct alignas(32) Node {
+        float bounds[6][Width]; // Child box minimum x, y, z followed by maximum x, y, z
+        int32_t child[Width]; // Node index for interior children, first primitive for leaves, -1 for empty slots
+        uint32_t count[Width]; // Primitive count for leaves, 0 otherwise
+    };
+
+    struct StackEntry {
+        int32_t child;
+        uint32_t count;
+        float t;
+    };
+
+    struct PacketEntry {
+        int32_t child;
+        uint32_t count;
+        uint32_t mask; // Rays that entered the child
+        float t; // Nearest entry distance among them
+    };
+
+    // Per-ray constants shared by every node test
+    struct RayData {
+        float origin[3];
+        float inv_dir[3];
+        int near_row[3]; // Row of Node::bounds holding the entry plane for each axis
+        int far_row[3];
+
+        RayData() = default;
+
+        explicit RayData(const Ray& ray) {
+            for (int a = 0; a < 3; ++a) {
+                origin[a] = static_cast<float>(ray.origin()[a]);
+                inv_dir[a] = static_cast<float>(1.0 / ray.direction()[a]);
+                near_row[a] = std::signbit(inv_dir[a]) ? a + 3 : a;
+                far_row[a] = std::signbit(inv_dir[a]) ? a : a + 3;
+            }
+        }
+    };
+
+    static constexpr int stack_size = BvhBuilder::max_depth * (Width - 1) + 1;
+    static constexpr float far_scale = 1.0f + 1e-6f; // Absorbs float rounding of the exit distance
+
+    // Per-ray stacks of traverseInterleaved(), kept by each thread and reused across calls instead of reserving the
+    // worst case on the call stack every time. A leaf callback may traverse a nested hierarchy, such as a SphereSet
+    // under a top-level leaf, so every level of nesting has its own block.
+    struct InterleavedStacks {
+        std::vector<std::vector<StackEntry>> levels;
+        size_t level = 0;
+    };
+
+    static InterleavedStacks& interleavedStacks() {
+        static thread_local InterleavedStacks stacks;
+        return stacks;
+    }
+
+    std::vector<Node> nodes;
+    double padding = 0;
+    size_t leaf_count = 0;
+    int depth = 0; // Levels of nodes below and including the root
+
+    // Pushes the children in `mask` farthest first, so the nearest is popped next
+    static void pushChildren(const Node& node, unsigned int mask, const float* t_near, StackEntry* stack, int& sp) {
+        int first = sp;
+        while (mask) {
+            int c = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            StackEntry child_entry{node.child[c], node.count[c], t_near[c]};
+            int k = sp++;
+            while (k > first && stack[k - 1].t < child_entry.t) {
+                stack[k] = stack[k - 1];
+                --k;
+            }
+            stack[k] = child_entry;
+        }
+    }
+
+    // Tests the ray against every child box of the node, returning a bit mask of the children hit inside
+    // [t_min, t_max] and their entry distances
+    template<SimdLevel Level>
+    static unsigned int intersectChildren(const Node& node, const RayData& rd, float t_min, float t_max,
+                                          float* t_near) {
+#if defined(RAYTRACER_SIMD_DISPATCH)
+        if constexpr (Width == 8 && Level >= SimdLevel::Avx2) {
+            return intersectChildrenAvx(node, rd, t_min, t_max, t_near);
+        }
+#endif
+#if defined(__SSE2__)
+        if constexpr (Level >= SimdLevel::Sse2) {
+            unsigned int mask = 0;
+            for (int g = 0; g < Width; g += 4) {
+                __m128 t_enter = _mm_set1_ps(t_min);
+                __m128 t_exit = _mm_set1_ps(t_max);
+                for (int a = 0; a < 3; ++a) {
+                    __m128 o = _mm_set1_ps(rd.origin[a]);
+                    __m128 inv = _mm_set1_ps(rd.inv_dir[a]);
+                    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[rd.near_row[a]][g]), o), inv);
+                    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[rd.far_row[a]][g]), o), inv);
+                    // NaNs from rays parallel to and inside a slab leave the running interval unchanged
+                    t_enter = _mm_max_ps(t0, t_enter);
+                    t_exit = _mm_min_ps(t1, t_exit);
+                }
+                _mm_storeu_ps(t_near + g, t_enter);
+                mask |= static_cast<unsigned int>(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit))) << g;
+            }
+            return mask;
+        }
+#endif
+        unsigned int mask = 0;
+        for (int c = 0; c < Width; ++c) {
+            float t_enter = t_min;
+            float t_exit = t_max;
+            for (int a = 0; a < 3; ++a) {
+                float t0 = (node.bounds[rd.near_row[a]][c] - rd.origin[a]) * rd.inv_dir[a];
+                float t1 = (node.bounds[rd.far_row[a]][c] - rd.origin[a]) * rd.inv_dir[a];
+                t_enter = t0 > t_enter ? t0 : t_enter;
+                t_exit = t1 < t_exit ? t1 : t_exit;
+            }
+            t_near[c] = t_enter;
+            mask |= static_cast<unsigned int>(t_enter <= t_exit) << c;
+        }
+        return mask;
+    }
+
+#if defined(RAYTRACER_SIMD_DISPATCH)
+    // All eight children in one AVX register
+    RAYTRACER_TARGET_AVX2 static unsigned int intersectChildrenAvx(const Node& node, const RayData& rd, float t_min,
+                                                                   float t_max, float* t_near) {
+        __m256 t_enter = _mm256_set1_ps(t_min);
+        __m256 t_exit = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; ++a) {
+            __m256 o = _mm256_set1_ps(rd.origin[a]);
+            __m256 inv = _mm256_set1_ps(rd.inv_dir[a]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[rd.near_row[a]]), o), inv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[rd.far_row[a]]), o), inv);
+            t_enter = _mm256_max_ps(t0, t_enter);
+            t_exit = _mm256_min_ps(t1, t_exit);
+        }
+        _mm256_storeu_ps(t_near, t_enter);
+        return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+    }
+#endif
+
+    // Fills nodes[index] with the up to Width descendants of a binary node, opening the child with the largest
+    // surface area until the node is full, then recurses into the interior children. level counts the root as 1.
+    template<typename LeafOffset>
+    void collapse(const BvhBuildNode& build_node, size_t index, int level, LeafOffset& leaf_offset) {
+        depth = std::max(depth, level);
+        const BvhBuildNode* children[Width];
+        int n_children = 0;
+
+        if (build_node.isLeaf()) {
+            children[n_children++] = &build_node;
+        } else {
+            children[n_children++] = build_node.children[0].get();
+            children[n_children++] = build_node.children[1].get();
+        }
+
+        while (n_children < Width) {
+            int widest = -1;
+            double widest_area = -1;
+            for (int c = 0; c < n_children; ++c) {
+                if (!children[c]->isLeaf() && children[c]->bbox.surfaceArea() > widest_area) {
+                    widest = c;
+                    widest_area = children[c]->bbox.surfaceArea();
+                }
+            }
+            if (widest < 0) {
+                break;
+            }
+
+            const BvhBuildNode* opened = children[widest];
+            children[widest] = opened->children[0].get();
+            children[n_children++] = opened->children[1].get();
+        }
+
+        for (int c = 0; c < Width; ++c) {
+            setChildBox(index, c, c < n_children ? children[c]->bbox : AABB());
+            nodes[index].child[c] = -1;
+            nodes[index].count[c] = 0;
+        }
+
+        for (int c = 0; c < n_children; ++c) {
+            const auto* child = children[c];
+            if (child->isLeaf()) {
+                if (child->primitive_count > 0) {
+                    nodes[index].child[c] = static_cast<int32_t>(leaf_offset(child->first_primitive));
+                    nodes[index].count[c] = static_cast<uint32_t>(child->primitive_count);
+                    ++leaf_count;
+                } else {
+                    setChildBox(index, c, AABB());
+                }
+                continue;
+            }
+
+            auto child_index = nodes.size();
+            nodes.emplace_back(); // May reallocate, so nodes[index] is looked up again afterwards
+            nodes[index].child[c] = static_cast<int32_t>(child_index);
+            collapse(*child, child_index, level + 1, leaf_offset);
+        }
+    }
+
+    void setChildBox(size_t index, int c, const AABB& box) {
+        auto& node = nodes[index];
+        if (box.isEmpty()) {
+            // An inverted box is missed by every ray
+            for (int a = 0; a < 3; ++a) {
+                node.bounds[a][c] = infinity;
+                node.bounds[a + 3][c] = -infinity;
+            }
+            return;
+        }
+
+        for (int a = 0; a < 3; ++a) {
+            node.bounds[a][c] = roundDownToFloat(box.axis(a).min - padding);
+            node.bounds[a + 3][c] = roundUpToFloat(box.axis(a).max + padding);
+        }
+    }
+};
+
+// Bounding volume hierarchy over a list of hittables with Width children per node, see WideBvhNodes
+template<int Width>
+class WideBvh : public Hittable {
+public:
+    explicit WideBvh(const HittableList& list, unsigned int max_threads = 1) : level(simdLevel()) {
+        BvhBuilder builder(BvhBuilder::boundingBoxes(list), max_threads);
+        auto start_time = std::chrono::steady_clock::now();
+
+        primitives = builder.reorder(list.objects);
+        bbox = builder.root->bbox;
+        hierarchy = WideBvhNodes<Width>(*builder.root);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        build_stats = builder.stats;
+        build_stats.build_seconds += elapsed.count();
+        build_stats.node_count = hierarchy.nodeCount();
+        build_stats.leaf_count = hierarchy.leafCount();
+        build_stats.memory_bytes = hierarchy.memoryBytes() + primitives.size() * sizeof(primitives[0]);
+    }
+
+    uint32_t hitPacket(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const override {
+        return dispatchSimd(level, [&](auto tag) {
+            return hierarchy.template traversePacket<decltype(tag)::value>(rays, active, ray_t,
+                                                                           [&](uint32_t first, uint32_t count,
+                                                                               uint32_t mask, Interval* leaf_t) {
+                uint32_t hits = 0;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    hits |= primitives[i]->hitPacket(rays, mask, leaf_t, recs);
+                }
+                return hits;
+            });
+        });
+    }
+
+    bool occluded(const Ray& ray, Interval ray_t) const override {
+        return dispatchSimd(level, [&](auto tag) {
+            return hierarchy.template traverse<decltype(tag)::value, true>(ray, ray_t,
+                                                                           [&](uint32_t first, uint32_t count,
+                                                                               Interval& leaf_t) {
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (primitives[i]->occluded(ray, leaf_t)) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        });
+    }
+
+    // The objects of a scene are few and large, such as sphere sets with their own hierarchies, so this level is
+    // traversed as a packet and each object interleaves the rays that reach it
+    uint32_t hitInterleaved(const Ray* rays, uint32_t active, Interval* ray_t, HitRecord* recs) const override {
+        return dispatchSimd(level, [&](auto tag) {
+            return hierarchy.template traversePacket<decltype(tag)::value>(rays, active, ray_t,
+                                                                           [&](uint32_t first, uint32_t count,
+                                                                               uint32_t mask, Interval* leaf_t) {
+                uint32_t hits = 0;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    hits |= primitives[i]->hitInterleaved(rays, mask, leaf_t, recs);
+                }
+                return hits;
+            });
+        });
+    }
+
+    bool hit(const Ray &ray, Interval ray_t, HitRecord& rec) const override {
+        return dispatchSimd(level, [&](auto tag) {
+            return hierarchy.template traverse<decltype(tag)::value>(ray, ray_t,
+                                                                     [&](uint32_t first, uint32_t count,
+                                                                         Interval& leaf_t) {
+                bool hit_anything = false;
+                for (uint32_t i = first; i < first + count; ++i) {
+                    if (primitives[i]->hit(ray, leaf_t, rec)) {
+                        hit_anything = true;
+                        leaf_t.max = rec.t;
+                    }
+                }
+                return hit_anything;
+            });
+        });
+    }
+
+    void collectLights(const MaterialTable& materials, LightList& lights) const override {
+        for (const auto& primitive : primitives) {
+            primitive->collectLights(materials, lights);
+        }
+    }
+
+    AABB boundingBox() const override { return bbox; }
+
+    [[nodiscard]] const BvhBuildStats& stats() const { return build_stats; }
+
+private:
+    SimdLevel level;
+    WideBvhNodes<Width> hierarchy;
+    std::vector<shared_ptr<Hittable>> primitives;
+    AABB bbox;
+    BvhBuildStats build_stats;
+};
+
+using Bvh4 = WideBvh<4>;
+using Bvh8 = WideBvh<8>;
+
+#endif //RAYTRACER_WIDE_BVH_H